@@ -92,3 +92,24 @@ TEST_CASE("Deer", "[no_asan]") {
     render_opts.mode = RenderMode::kNormal;
     CheckImage("deer/CERF_Free.obj", "deer/normal.png", camera_opts, render_opts);
 }
+
+TEST_CASE("Rasterized primary visibility", "[no_asan]") {
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4, RenderMode::kDepth, true};
+    CheckImage("box/cube.obj", "box/depth.png", camera_opts, render_opts);
+    render_opts.mode = RenderMode::kNormal;
+    CheckImage("box/cube.obj", "box/normal.png", camera_opts, render_opts);
+
+    camera_opts = {.screen_width = 500,
+                   .screen_height = 500,
+                   .look_from = {100., 200., 150.},
+                   .look_to = {0., 100., 0.}};
+    render_opts = {1, RenderMode::kDepth, true};
+    CheckImage("deer/CERF_Free.obj", "deer/depth.png", camera_opts, render_opts);
+    render_opts.mode = RenderMode::kNormal;
+    CheckImage("deer/CERF_Free.obj", "deer/normal.png", camera_opts, render_opts);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <limits>
+
+class BoundingBox {
+public:
+    BoundingBox()
+        : min_(std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+               std::numeric_limits<double>::infinity()),
+          max_(-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+               -std::numeric_limits<double>::infinity()) {
+    }
+
+    BoundingBox(const Vector& min, const Vector& max) : min_(min), max_(max) {
+    }
+
+    const Vector& GetMin() const {
+        return min_;
+    }
+    const Vector& GetMax() const {
+        return max_;
+    }
+
+    Vector GetCenter() const {
+        return (min_ + max_) * 0.5;
+    }
+
+    bool IsEmpty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+
+    void Extend(const Vector& point) {
+        for (size_t i = 0; i < 3; ++i) {
+            min_[i] = std::min(min_[i], point[i]);
+            max_[i] = std::max(max_[i], point[i]);
+        }
+    }
+
+    void Extend(const BoundingBox& other) {
+        Extend(other.min_);
+        Extend(other.max_);
+    }
+
+private:
+    Vector min_;
+    Vector max_;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+// Runtime selection between builds of the hot kernels for different instruction sets, so that a
+// single binary uses AVX2 or AVX-512 where the CPU has them and still runs on SSE4.2 machines.
+//
+// A kernel is written once as an always-inline Impl function and RAYTRACER_DEFINE_KERNEL
+// compiles it for every level; anything it inlines, such as GetIntersection, is compiled for
+// that level too. The level is detected on first use and can be forced with SetIsaOverride() or
+// the RAYTRACER_ISA environment variable (generic, sse4.2, avx2 or avx512) for testing.
+//
+// Every path gives bit-identical results only if multiplies and adds aren't contracted into FMA,
+// which AVX-512 implies. GCC turns contraction off for that level with an attribute. Clang
+// contracts within expressions by default and has no such attribute, and its fp pragma doesn't
+// reach the inlined Vector operators, so targets built by clang need -ffp-contract=off. CMake
+// targets get it by linking against raytracer_kernels.
+enum class Isa { kGeneric, kSse42, kAvx2, kAvx512 };
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYTRACER_X86_DISPATCH 1
+#define RAYTRACER_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define RAYTRACER_TARGET_AVX2 __attribute__((target("avx2")))
+#if defined(__clang__)
+// Relies on -ffp-contract=off, see above.
+#define RAYTRACER_TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw")))
+#else
+#define RAYTRACER_TARGET_AVX512 \
+    __attribute__((target("avx512f,avx512dq,avx512vl,avx512bw"), optimize("fp-contract=off")))
+#endif
+#else
+#define RAYTRACER_TARGET_SSE42
+#define RAYTRACER_TARGET_AVX2
+#define RAYTRACER_TARGET_AVX512
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+// At -O2 GCC only vectorizes loops that need no scalar epilogue, which rules out rows of any
+// width. Vectorizing doesn't reorder floating point operations, so results stay the same. It has
+// to follow the target attribute, or it drops the optimize options given there.
+#define RAYTRACER_VECTORIZE __attribute__((optimize("vect-cost-model=dynamic")))
+#else
+#define RAYTRACER_VECTORIZE
+#endif
+
+#define RAYTRACER_KERNEL [[gnu::always_inline]] inline
+
+const char* GetIsaName(Isa isa) {
+    switch (isa) {
+        case Isa::kSse42:
+            return "sse4.2";
+        case Isa::kAvx2:
+            return "avx2";
+        case Isa::kAvx512:
+            return "avx512";
+        default:
+            return "generic";
+    }
+}
+
+Isa ParseIsa(const std::string& name) {
+    for (auto isa : {Isa::kGeneric, Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+        if (name == GetIsaName(isa)) {
+            return isa;
+        }
+    }
+    throw std::runtime_error("Unknown instruction set " + name);
+}
+
+// The best level the CPU supports.
+Isa DetectIsa() {
+#ifdef RAYTRACER_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw")) {
+        return Isa::kAvx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::kAvx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return Isa::kSse42;
+    }
+#endif
+    return Isa::kGeneric;
+}
+
+bool IsIsaSupported(Isa isa) {
+    return isa <= DetectIsa();
+}
+
+Isa SelectIsa() {
+    auto isa = DetectIsa();
+    if (const char* name = std::getenv("RAYTRACER_ISA")) {
+        auto requested = ParseIsa(name);
+        if (!IsIsaSupported(requested)) {
+            throw std::runtime_error(std::string("Instruction set ") + name +
+                                     " is not supported by this CPU");
+        }
+        isa = requested;
+    }
+    return isa;
+}
+
+// The selected level, or -1 before the first use.
+std::atomic<int>& GetIsaState() {
+    static std::atomic<int> isa = -1;
+    return isa;
+}
+
+// The level that kernels run at.
+Isa GetIsa() {
+    auto isa = GetIsaState().load(std::memory_order_relaxed);
+    if (isa < 0) {
+        isa = static_cast<int>(SelectIsa());
+        GetIsaState().store(isa, std::memory_order_relaxed);
+    }
+    return static_cast<Isa>(isa);
+}
+
+// Forces the level of all kernels, or goes back to the detected one. Throws if the CPU lacks it.
+void SetIsaOverride(std::optional<Isa> isa) {
+    if (isa && !IsIsaSupported(isa.value())) {
+        throw std::runtime_error(std::string("Instruction set ") + GetIsaName(isa.value()) +
+                                 " is not supported by this CPU");
+    }
+    GetIsaState().store(static_cast<int>(isa ? isa.value() : DetectIsa()),
+                        std::memory_order_relaxed);
+}
+
+// Defines Name##Generic, Name##Sse42, Name##Avx2 and Name##Avx512 that run Impl compiled for
+// the level, and Name that calls the one of GetIsa(). Params and Args are parenthesized lists.
+#define RAYTRACER_DEFINE_KERNEL(Return, Name, Impl, Params, Args)                                  \
+    RAYTRACER_VECTORIZE Return Name##Generic Params {                                              \
+        return Impl Args;                                                                          \
+    }                                                                                              \
+    RAYTRACER_TARGET_SSE42 RAYTRACER_VECTORIZE Return Name##Sse42 Params {                         \
+        return Impl Args;                                                                          \
+    }                                                                                              \
+    RAYTRACER_TARGET_AVX2 RAYTRACER_VECTORIZE Return Name##Avx2 Params {                           \
+        return Impl Args;                                                                          \
+    }                                                                                              \
+    RAYTRACER_TARGET_AVX512 RAYTRACER_VECTORIZE Return Name##Avx512 Params {                       \
+        return Impl Args;                                                                          \
+    }                                                                                              \
+    Return Name Params {                                                                           \
+        switch (GetIsa()) {                                                                        \
+            case Isa::kAvx512:                                                                     \
+                return Name##Avx512 Args;                                                          \
+            case Isa::kAvx2:                                                                       \
+                return Name##Avx2 Args;                                                            \
+            case Isa::kSse42:                                                                      \
+                return Name##Sse42 Args;                                                           \
+            default:                                                                               \
+                return Name##Generic Args;                                                         \
+        }                                                                                          \
+    }
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <vector.h>
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+// Approximations for shading in previews, where RenderOptions::fast_math trades exactness for
+// fewer libm calls and divides. They handle only the finite, non-negative inputs shading
+// produces; the error bounds are checked by the "Fast math" test.
+
+// log2 at the centers of 128 mantissa buckets and 2^(i / 64), so that FastLog2 and FastExp2
+// only need a short polynomial around a table entry.
+class FastMathTables {
+public:
+    static constexpr int kLogBits = 7;
+    static constexpr int kExpBits = 6;
+
+    FastMathTables() {
+        for (size_t i = 0; i < inverse_centers_.size(); ++i) {
+            double center = 1 + (i + 0.5) / inverse_centers_.size();
+            inverse_centers_[i] = 1 / center;
+            log_centers_[i] = std::log2(center);
+        }
+        for (size_t i = 0; i < exp_steps_.size(); ++i) {
+            exp_steps_[i] = std::exp2(static_cast<double>(i) / exp_steps_.size());
+        }
+    }
+
+    static const FastMathTables& Get() {
+        static const FastMathTables kTables;
+        return kTables;
+    }
+
+    double InverseCenter(size_t i) const {
+        return inverse_centers_[i];
+    }
+
+    double LogCenter(size_t i) const {
+        return log_centers_[i];
+    }
+
+    double ExpStep(size_t i) const {
+        return exp_steps_[i];
+    }
+
+private:
+    std::array<double, 1 << kLogBits> inverse_centers_;
+    std::array<double, 1 << kLogBits> log_centers_;
+    std::array<double, 1 << kExpBits> exp_steps_;
+};
+
+// log2(x) for positive normal x, with absolute error below 1e-10: the bucket of the top
+// mantissa bits gives log2 of its center c, and log2(m / c) is a cubic in m / c - 1.
+double FastLog2(double x) {
+    if (x <= 0) {
+        return -std::numeric_limits<double>::infinity();
+    }
+    const auto& tables = FastMathTables::Get();
+    auto bits = std::bit_cast<uint64_t>(x);
+    auto exponent = static_cast<int>(bits >> 52) - 1023;
+    auto m = std::bit_cast<double>((bits & 0xfffffffffffff) | 0x3ff0000000000000);
+    constexpr int kBuckets = 1 << FastMathTables::kLogBits;
+    auto bucket = (bits >> (52 - FastMathTables::kLogBits)) & (kBuckets - 1);
+
+    constexpr double kInvLn2 = 1.4426950408889634;
+    double r = m * tables.InverseCenter(bucket) - 1;
+    double log = r * (kInvLn2 + r * (-kInvLn2 / 2 + r * (kInvLn2 / 3)));
+    return exponent + tables.LogCenter(bucket) + log;
+}
+
+// 2^x with relative error below 1e-10, and 0 below the normal range: x is rounded to a multiple
+// of 1/64 looked up in the table, and the rest goes through a cubic of e^(x ln 2).
+double FastExp2(double x) {
+    if (x < -1022) {
+        return 0;
+    }
+    if (x > 1023) {
+        return std::numeric_limits<double>::infinity();
+    }
+    constexpr int kSteps = 1 << FastMathTables::kExpBits;
+    // Biased so that the integer part is the exponent field of the result.
+    double biased = x + 1023;
+    auto n = static_cast<int64_t>(biased * kSteps + 0.5);
+    double f = (biased - static_cast<double>(n) / kSteps) * 0.6931471805599453;
+    double p = 1 + f * (1 + f * (1. / 2 + f * (1. / 6)));
+    auto scale = std::bit_cast<double>(static_cast<uint64_t>(n >> FastMathTables::kExpBits) << 52);
+    return p * FastMathTables::Get().ExpStep(n & (kSteps - 1)) * scale;
+}
+
+// x^y for x >= 0 as 2^(y log2 x). The relative error grows with |y|: below 1e-10 times
+// (1 + |y|), so below 1e-7 for specular exponents up to 1000.
+double FastPow(double x, double y) {
+    if (y == 0) {
+        return 1;
+    }
+    if (x <= 0) {
+        return 0;
+    }
+    return FastExp2(y * FastLog2(x));
+}
+
+// 1 / sqrt(x) for positive normal x, with relative error below 5e-6: the exponent-halving bit
+// trick followed by two Newton steps.
+double FastRsqrt(double x) {
+    auto y = std::bit_cast<double>(0x5fe6eb50c7b537a9 - (std::bit_cast<uint64_t>(x) >> 1));
+    y *= 1.5 - 0.5 * x * y * y;
+    y *= 1.5 - 0.5 * x * y * y;
+    return y;
+}
+
+// v scaled by FastRsqrt of its squared length instead of divided by its length.
+Vector FastNormalized(const Vector& v) {
+    return v * FastRsqrt(DotProduct(v, v));
+}
@@ -4,11 +4,19 @@
 #include <sphere.h>
 #include <intersection.h>
 #include <triangle.h>
+#include <polygon.h>
 #include <ray.h>
+#include <bounding_box.h>
+#include <cpu_dispatch.h>
 
+#include <algorithm>
+#include <cmath>
 #include <optional>
+#include <limits>
+#include <utility>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+RAYTRACER_KERNEL std::optional<Intersection> GetIntersection(const Ray& ray,
+                                                             const Sphere& sphere) {
     auto b = 2 * DotProduct(ray.GetDirection(), ray.GetOrigin() - sphere.GetCenter());
     auto vl = ray.GetOrigin() - sphere.GetCenter();
 
@@ -50,6 +58,30 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere
     return std::nullopt;
 }
 
+// Distance along the ray at which it enters the box (0 if it starts inside), or nullopt if it
+// misses the box.
+std::optional<double> GetIntersectionDistance(const Ray& ray, const BoundingBox& box) {
+    double t_near = 0;
+    double t_far = std::numeric_limits<double>::infinity();
+
+    for (size_t i = 0; i < 3; ++i) {
+        double inv_direction = 1 / ray.GetDirection()[i];
+        double t0 = (box.GetMin()[i] - ray.GetOrigin()[i]) * inv_direction;
+        double t1 = (box.GetMax()[i] - ray.GetOrigin()[i]) * inv_direction;
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        // NaN appears for a ray lying in a slab plane; treat it as inside that slab.
+        t_near = t0 > t_near ? t0 : t_near;
+        t_far = t1 < t_far ? t1 : t_far;
+        if (t_near > t_far) {
+            return std::nullopt;
+        }
+    }
+
+    return t_near;
+}
+
 Vector Reflect(const Vector& ray, const Vector& normal) {
     return ray - normal * 2 * DotProduct(ray, normal);
 }
@@ -65,7 +97,7 @@ std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double et
     return ray * eta - normal * (eta * cos + std::sqrt(k));
 }
 
-Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
+RAYTRACER_KERNEL Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
     Vector ab = triangle[1] - triangle[0];
     Vector ac = triangle[2] - triangle[0];
     Vector ap = point - triangle[0];
@@ -89,7 +121,8 @@ Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
     };
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+RAYTRACER_KERNEL std::optional<Intersection> GetIntersection(const Ray& ray,
+                                                             const Triangle& triangle) {
 
     const double epsilon = 0.0000001;
 
@@ -171,4 +204,54 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
 //     } else {
 //         return std::nullopt;
 //     }
-// }
\ No newline at end of file
+// }
+// One plane test, then the hit point is checked against every edge. Points on an edge count as
+// inside, as for triangles.
+RAYTRACER_KERNEL std::optional<Intersection> GetIntersection(const Ray& ray,
+                                                             const ConvexPolygon& polygon) {
+    const double epsilon = 0.0000001;
+
+    const Vector& normal = polygon.GetNormal();
+    double cos = DotProduct(normal, ray.GetDirection());
+    if (std::fabs(cos) < std::numeric_limits<double>::epsilon()) {
+        return std::nullopt;  // Ray is parallel to the polygon.
+    }
+
+    double t = DotProduct(polygon[0] - ray.GetOrigin(), normal) / cos;
+    if (!(t > epsilon)) {
+        return std::nullopt;
+    }
+
+    Vector point = ray.GetOrigin() + ray.GetDirection() * t;
+    for (size_t i = 0; i < polygon.Size(); ++i) {
+        const auto& a = polygon[i];
+        const auto& b = polygon[i + 1 == polygon.Size() ? 0 : i + 1];
+        if (DotProduct(CrossProduct(b - a, point - a), normal) < 0) {
+            return std::nullopt;
+        }
+    }
+
+    return Intersection(point, cos > 0 ? normal * -1 : normal, t);
+}
+
+// Barycentric coordinates of the point in the triangle (0, i, i + 1) of the polygon's fan that
+// contains it, with i stored into fan. These are the coordinates a fan triangulation of the
+// polygon would interpolate with.
+Vector GetFanBarycentricCoords(const ConvexPolygon& polygon, const Vector& point, size_t* fan) {
+    Vector best;
+    double best_min = -std::numeric_limits<double>::infinity();
+    for (size_t i = 1; i + 1 < polygon.Size(); ++i) {
+        auto coords =
+            GetBarycentricCoords(Triangle{polygon[0], polygon[i], polygon[i + 1]}, point);
+        double min = std::min({coords[0], coords[1], coords[2]});
+        if (min > best_min) {
+            best_min = min;
+            best = coords;
+            *fan = i;
+        }
+        if (min >= 0) {
+            break;
+        }
+    }
+    return best;
+}
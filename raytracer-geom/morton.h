@@ -0,0 +1,32 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <cstdint>
+
+// Spreads the lower 21 bits of value so that there are two zero bits between each of them.
+uint64_t SpreadBits(uint64_t value) {
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8) & 0x100f00f00f00f00f;
+    value = (value | value << 4) & 0x10c30c30c30c30c3;
+    value = (value | value << 2) & 0x1249249249249249;
+    return value;
+}
+
+// Position of the point along the Z-order curve through bounds, 21 bits per axis. Points close
+// in space mostly get close codes.
+uint64_t GetMortonCode(const Vector& point, const BoundingBox& bounds) {
+    constexpr double kScale = (1 << 21) - 1;
+
+    uint64_t code = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        double extent = bounds.GetMax()[i] - bounds.GetMin()[i];
+        double t = extent > 0 ? (point[i] - bounds.GetMin()[i]) / extent : 0;
+        code |= SpreadBits(static_cast<uint64_t>(std::clamp(t, 0., 1.) * kScale)) << i;
+    }
+    return code;
+}
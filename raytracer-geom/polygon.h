@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Sum of the cross products of consecutive vertices relative to the first one: a normal whose
+// length is twice the area for planar polygons, pointing to where the vertices run
+// counterclockwise.
+Vector GetAreaNormal(const std::vector<Vector>& vertices) {
+    Vector normal;
+    for (size_t i = 1; i + 1 < vertices.size(); ++i) {
+        normal = normal + CrossProduct(vertices[i] - vertices[0], vertices[i + 1] - vertices[0]);
+    }
+    return normal;
+}
+
+// Whether the vertices form a planar, strictly convex polygon. Points may be off the plane by
+// tolerance times the polygon's size.
+bool IsConvexPolygon(const std::vector<Vector>& vertices, double tolerance = 1e-9) {
+    if (vertices.size() < 3) {
+        return false;
+    }
+    auto normal = GetAreaNormal(vertices);
+    if (Length(normal) == 0) {
+        return false;
+    }
+    normal.Normalize();
+
+    double size = 0;
+    for (const auto& vertex : vertices) {
+        size = std::max(size, Length(vertex - vertices[0]));
+    }
+    for (const auto& vertex : vertices) {
+        if (std::fabs(DotProduct(vertex - vertices[0], normal)) > tolerance * size) {
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        const auto& a = vertices[i];
+        const auto& b = vertices[(i + 1) % vertices.size()];
+        const auto& c = vertices[(i + 2) % vertices.size()];
+        if (DotProduct(CrossProduct(b - a, c - b), normal) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A planar convex polygon whose vertices, in order, are picked by index from a shared array, so
+// that the polygons of a mesh share their vertices and own no memory. Both arrays must outlive
+// it. The constructor doesn't check convexity; see IsConvexPolygon.
+class ConvexPolygon {
+public:
+    ConvexPolygon(const Vector* vertices, const uint32_t* indices, size_t size,
+                  const Vector& normal)
+        : vertices_(vertices), indices_(indices), size_(size), normal_(normal) {
+    }
+
+    // Computes the normal from the vertices.
+    ConvexPolygon(const Vector* vertices, const uint32_t* indices, size_t size)
+        : ConvexPolygon(vertices, indices, size, {}) {
+        normal_ = GetAreaNormal();
+        normal_.Normalize();
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    const Vector& operator[](size_t ind) const {
+        return vertices_[indices_[ind]];
+    }
+
+    // Unit normal, oriented by the winding of the vertices.
+    const Vector& GetNormal() const {
+        return normal_;
+    }
+
+    double Area() const {
+        return Length(GetAreaNormal()) / 2;
+    }
+
+private:
+    Vector GetAreaNormal() const {
+        Vector normal;
+        for (size_t i = 1; i + 1 < size_; ++i) {
+            const auto& first = (*this)[0];
+            normal = normal + CrossProduct((*this)[i] - first, (*this)[i + 1] - first);
+        }
+        return normal;
+    }
+
+    const Vector* vertices_;
+    const uint32_t* indices_;
+    size_t size_;
+    Vector normal_;
+};
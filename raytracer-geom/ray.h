@@ -8,6 +8,14 @@ public:
         direction_.Normalize();
     }
 
+    // Skips the normalization for directions that already have unit length.
+    static Ray FromUnitDirection(const Vector& origin, const Vector& direction) {
+        Ray ray;
+        ray.origin_ = origin;
+        ray.direction_ = direction;
+        return ray;
+    }
+
     const Vector& GetOrigin() const {
         return origin_;
     }
@@ -16,6 +24,8 @@ public:
     }
 
 private:
+    Ray() = default;
+
     Vector origin_;
     Vector direction_;
 };
@@ -1,4 +1,5 @@
 #include <geometry.h>
+#include <fast_math.h>
 #include <util.h>
 
 #include <cmath>
@@ -7,6 +8,9 @@
 #include <fstream>
 #include <algorithm>
 #include <array>
+#include <random>
+#include <vector>
+#include <cstdint>
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
@@ -220,6 +224,49 @@ TEST_CASE("Triangle intersection") {
     }
 }
 
+TEST_CASE("Convex polygon intersection") {
+    std::ifstream is{GetFileDir(__FILE__) / "triangle.txt"};
+    int n;
+    is >> n;
+    while (n--) {
+        auto ray = ReadRay(&is);
+        auto triangle = ReadTriangle(&is);
+        std::vector<Vector> vertices = {triangle[0], triangle[1], triangle[2]};
+        const uint32_t indices[] = {0, 1, 2};
+        ConvexPolygon polygon(vertices.data(), indices, 3);
+        CheckIntersection(GetIntersection(ray, polygon), &is);
+    }
+
+    // The quad picks its vertices out of order from a larger array.
+    std::vector<Vector> vertices = {{2, 2, 0}, {5, 5, 5}, {0, 0, 0}, {0, 2, 0}, {2, 0, 0}};
+    const uint32_t indices[] = {2, 4, 0, 3};
+    ConvexPolygon quad(vertices.data(), indices, 4);
+    CHECK(IsConvexPolygon({quad[0], quad[1], quad[2], quad[3]}));
+    CHECK_THAT(quad.Area(), WithinAbs(4));
+    CheckEquals(quad.GetNormal(), {0, 0, 1});
+
+    auto hit = GetIntersection(Ray{{1.5, 0.5, 3}, {0, 0, -1}}, quad);
+    REQUIRE(hit);
+    CHECK_THAT(hit->GetDistance(), WithinAbs(3));
+    CheckWithinAbs(hit->GetPosition(), {1.5, 0.5, 0});
+    CheckWithinAbs(hit->GetNormal(), {0, 0, 1});
+    CHECK(GetIntersection(Ray{{1, 1, -1}, {0, 0, -1}}, quad) == std::nullopt);
+    CHECK(GetIntersection(Ray{{2.5, 1, 1}, {0, 0, -1}}, quad) == std::nullopt);
+    CHECK(GetIntersection(Ray{{2, 2, 1}, {0, 0, -1}}, quad));
+    CHECK(GetIntersection(Ray{{-1, 1, 0}, {1, 0, 0}}, quad) == std::nullopt);
+
+    size_t fan;
+    CheckWithinAbs(GetFanBarycentricCoords(quad, {1.5, 0.5, 0}, &fan), {0.25, 0.5, 0.25});
+    CHECK(fan == 1);
+    CheckWithinAbs(GetFanBarycentricCoords(quad, {0.5, 1.5, 0}, &fan), {0.25, 0.25, 0.5});
+    CHECK(fan == 2);
+
+    CHECK_FALSE(IsConvexPolygon({{0, 0, 0}, {2, 0, 0}, {1, 0.5, 0}, {2, 2, 0}, {0, 2, 0}}));
+    CHECK_FALSE(IsConvexPolygon({{0, 0, 0}, {2, 0, 0}, {2, 2, 0.5}, {0, 2, 0}}));
+    CHECK_FALSE(IsConvexPolygon({{0, 0, 0}, {1, 0, 0}, {2, 0, 0}, {2, 2, 0}}));
+    CHECK_FALSE(IsConvexPolygon({{0, 0, 0}, {1, 0, 0}}));
+}
+
 TEST_CASE("Refract, Reflect") {
     Vector normal{0, 1, 0};
     auto d = std::numbers::sqrt2 / 2;
@@ -285,3 +332,119 @@ TEST_CASE("Barycentric coords") {
         CheckCoords(t, {10, 7, 6}, {3. / 6, 2. / 6, 1. / 6});
     }
 }
+
+// Sums distances and barycentric coordinates of the hits of every ray with every triangle and
+// sphere, so that the dispatch test sees the result of many intersection tests.
+RAYTRACER_KERNEL Vector IntersectAllImpl(const std::vector<Ray>& rays,
+                                         const std::vector<Triangle>& triangles,
+                                         const std::vector<Sphere>& spheres) {
+    Vector sum;
+    for (const auto& ray : rays) {
+        for (const auto& triangle : triangles) {
+            if (auto hit = GetIntersection(ray, triangle)) {
+                sum += GetBarycentricCoords(triangle, hit->GetPosition()) + hit->GetDistance();
+            }
+        }
+        for (const auto& sphere : spheres) {
+            if (auto hit = GetIntersection(ray, sphere)) {
+                sum += hit->GetNormal() + hit->GetDistance();
+            }
+        }
+    }
+    return sum;
+}
+
+RAYTRACER_DEFINE_KERNEL(Vector, IntersectAll, IntersectAllImpl,
+                        (const std::vector<Ray>& rays, const std::vector<Triangle>& triangles,
+                         const std::vector<Sphere>& spheres),
+                        (rays, triangles, spheres))
+
+TEST_CASE("Instruction set dispatch") {
+    auto detected = DetectIsa();
+    CHECK(IsIsaSupported(detected));
+    CHECK(IsIsaSupported(Isa::kGeneric));
+    for (auto isa : {Isa::kGeneric, Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+        CHECK(ParseIsa(GetIsaName(isa)) == isa);
+    }
+    CHECK_THROWS(ParseIsa("mmx"));
+
+    std::mt19937_64 random(11);
+    auto uniform = [&random](double min, double max) {
+        return std::uniform_real_distribution<double>(min, max)(random);
+    };
+    auto random_point = [&uniform] {
+        return Vector{uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)};
+    };
+    std::vector<Ray> rays;
+    std::vector<Triangle> triangles;
+    std::vector<Sphere> spheres;
+    for (int i = 0; i < 200; ++i) {
+        rays.emplace_back(3 * random_point(), random_point());
+        triangles.emplace_back(random_point(), random_point(), random_point());
+        spheres.emplace_back(random_point(), uniform(.05, .3));
+    }
+
+    // Every level must give bit-identical results, both called directly and through dispatch.
+    auto expected = IntersectAllGeneric(rays, triangles, spheres);
+    REQUIRE(expected != Vector{});
+    for (auto isa : {Isa::kGeneric, Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+        INFO(GetIsaName(isa));
+        if (!IsIsaSupported(isa)) {
+            CHECK_THROWS(SetIsaOverride(isa));
+            continue;
+        }
+        SetIsaOverride(isa);
+        CHECK(GetIsa() == isa);
+        CHECK(IntersectAll(rays, triangles, spheres) == expected);
+    }
+    SetIsaOverride(std::nullopt);
+    CHECK(GetIsa() == detected);
+}
+
+TEST_CASE("Fused vector ops") {
+    static_assert(CrossProduct(Vector{1, 0, 0}, Vector{0, 1, 0}) == Vector{0, 0, 1});
+    static_assert(DotProduct(Vector{1, 2, 3}, Vector{4, 5, 6}) == 32);
+    static_assert(Vector{1, 2, 3}.AddScaled({1, 1, 1}, 2) == Vector{3, 4, 5});
+    static_assert(Vector{}.AddScaledProduct({1, 2, 3}, {2, 2, 2}, .5) == Vector{1, 2, 3});
+
+    Vector a{.1, .7, 1.3};
+    Vector b{2.9, -.3, .11};
+    Vector c{.37, 5.1, -8.2};
+    for (auto k : {.3, -1.7, 1e-5}) {
+        auto fused = a;
+        fused.AddScaled(b, k).AddScaledProduct(b, c, k);
+        CHECK(fused == a + k * b + k * b * c);
+    }
+
+    const Vector v{3, 0, 4};
+    CHECK(v.Normalized() == Vector{.6, 0, .8});
+    CHECK(v == Vector{3, 0, 4});
+}
+
+TEST_CASE("Fast math") {
+    std::mt19937_64 random(7);
+    auto uniform = [&random](double min, double max) {
+        return std::uniform_real_distribution<double>(min, max)(random);
+    };
+    for (int i = 0; i < 20000; ++i) {
+        double x = std::exp2(uniform(-100, 100));
+        CHECK(std::fabs(FastLog2(x) - std::log2(x)) < 1e-10);
+        CHECK(std::fabs(FastRsqrt(x) * std::sqrt(x) - 1) < 5e-6);
+
+        double power = uniform(-1000, 1000);
+        CHECK(std::fabs(FastExp2(power) / std::exp2(power) - 1) < 1e-10);
+
+        double base = uniform(0, 1);
+        double exponent = uniform(0, 1000);
+        double expected = std::pow(base, exponent);
+        if (expected > 1e-300) {
+            CHECK(std::fabs(FastPow(base, exponent) / expected - 1) < 1e-10 * (1 + exponent));
+        }
+    }
+    CHECK(FastPow(0, 10) == 0);
+    CHECK(FastPow(0, 0) == 1);
+    CHECK(FastExp2(-2000) == 0);
+
+    Vector v{3, 0, 4};
+    CHECK(Length(FastNormalized(v) - v.Normalized()) < 5e-6);
+}
@@ -6,13 +6,13 @@
 
 class Vector {
 public:
-    Vector() : data_{0, 0, 0} {};
-    Vector(double x, double y, double z) : data_{x, y, z} {};
+    constexpr Vector() : data_{0, 0, 0} {};
+    constexpr Vector(double x, double y, double z) : data_{x, y, z} {};
 
-    double& operator[](size_t ind) {
+    constexpr double& operator[](size_t ind) {
         return data_[ind];
     };
-    double operator[](size_t ind) const {
+    constexpr double operator[](size_t ind) const {
         return data_[ind];
     };
 
@@ -25,76 +25,92 @@ public:
         data_[2] /= len;
     }
 
-    Vector Normalized() {
+    Vector Normalized() const {
         Vector res = *this;
         res.Normalize();
         return res;
     }
 
-    bool operator==(const Vector& other) const {
+    constexpr bool operator==(const Vector& other) const {
         return data_[0] == other.data_[0] && data_[1] == other.data_[1] &&
                data_[2] == other.data_[2];
     }
 
-    bool operator!=(const Vector& other) const {
+    constexpr bool operator!=(const Vector& other) const {
         return !(*this == other);
     }
 
-    Vector operator+(const Vector& other) const {
+    constexpr Vector operator+(const Vector& other) const {
         return {data_[0] + other.data_[0], data_[1] + other.data_[1], data_[2] + other.data_[2]};
     }
 
-    Vector& operator+=(const Vector& other) {
+    constexpr Vector& operator+=(const Vector& other) {
         data_[0] += other.data_[0];
         data_[1] += other.data_[1];
         data_[2] += other.data_[2];
         return *this;
     }
 
-    Vector operator+(double k) const {
+    constexpr Vector operator+(double k) const {
         return {data_[0] + k, data_[1] + k, data_[2] + k};
     }
 
-    Vector operator-(const Vector& other) const {
+    constexpr Vector operator-(const Vector& other) const {
         return {data_[0] - other.data_[0], data_[1] - other.data_[1], data_[2] - other.data_[2]};
     }
 
-    Vector operator*(double k) const {
+    constexpr Vector operator*(double k) const {
         return {data_[0] * k, data_[1] * k, data_[2] * k};
     }
 
-    Vector operator/(double k) const {
+    constexpr Vector operator/(double k) const {
         return *this * (1 / k);
     }
 
-    Vector operator/(const Vector& other) const {
+    constexpr Vector operator/(const Vector& other) const {
         return {data_[0] / other.data_[0], data_[1] / other.data_[1], data_[2] / other.data_[2]};
     }
 
-    Vector operator*(const Vector& other) const {
+    constexpr Vector operator*(const Vector& other) const {
         return {data_[0] * other.data_[0], data_[1] * other.data_[1], data_[2] * other.data_[2]};
     }
 
-    friend Vector operator*(double k, const Vector& v);
-    friend Vector operator+(double k, const Vector& v);
+    // Fused forms of *this += v * k and *this += k * a * b that update the components in place
+    // in one pass. They round exactly like the expressions they replace.
+    constexpr Vector& AddScaled(const Vector& v, double k) {
+        data_[0] += v.data_[0] * k;
+        data_[1] += v.data_[1] * k;
+        data_[2] += v.data_[2] * k;
+        return *this;
+    }
+
+    constexpr Vector& AddScaledProduct(const Vector& a, const Vector& b, double k) {
+        data_[0] += k * a.data_[0] * b.data_[0];
+        data_[1] += k * a.data_[1] * b.data_[1];
+        data_[2] += k * a.data_[2] * b.data_[2];
+        return *this;
+    }
+
+    friend constexpr Vector operator*(double k, const Vector& v);
+    friend constexpr Vector operator+(double k, const Vector& v);
 
 private:
     std::array<double, 3> data_;
 };
 
-Vector operator*(double k, const Vector& v) {
+constexpr Vector operator*(double k, const Vector& v) {
     return v * k;
 }
 
-Vector operator+(double k, const Vector& v) {
+constexpr Vector operator+(double k, const Vector& v) {
     return v + k;
 }
 
-double DotProduct(const Vector& a, const Vector& b) {
+constexpr double DotProduct(const Vector& a, const Vector& b) {
     return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
 }
 
-Vector CrossProduct(const Vector& a, const Vector& b) {
+constexpr Vector CrossProduct(const Vector& a, const Vector& b) {
     return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
 }
 
@@ -0,0 +1,71 @@
+#include <scene_generator.h>
+
+#include <iostream>
+#include <string>
+
+// Usage: generate_scene [--option value]... <output .obj>
+int main(int argc, char** argv) {
+    SceneGeneratorOptions options;
+    std::string output;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg.rfind("--", 0) != 0) {
+                output = arg;
+                continue;
+            }
+            if (i + 1 == argc) {
+                throw std::runtime_error("Missing value of " + arg);
+            }
+            std::string value = argv[++i];
+            if (arg == "--triangles") {
+                options.triangles = std::stoull(value);
+            } else if (arg == "--spheres") {
+                options.spheres = std::stoull(value);
+            } else if (arg == "--lights") {
+                options.lights = std::stoull(value);
+            } else if (arg == "--mirror") {
+                options.mirror_fraction = std::stod(value);
+            } else if (arg == "--refractive") {
+                options.refractive_fraction = std::stod(value);
+            } else if (arg == "--diffuse") {
+                options.num_diffuse = std::stoull(value);
+            } else if (arg == "--distribution") {
+                if (value == "uniform") {
+                    options.distribution = SceneDistribution::kUniform;
+                } else if (value == "clustered") {
+                    options.distribution = SceneDistribution::kClustered;
+                } else {
+                    throw std::runtime_error("Unknown distribution " + value);
+                }
+            } else if (arg == "--clusters") {
+                options.clusters = std::stoull(value);
+            } else if (arg == "--extent") {
+                options.extent = std::stod(value);
+            } else if (arg == "--triangle-size") {
+                options.triangle_size = std::stod(value);
+            } else if (arg == "--sphere-radius") {
+                options.sphere_radius = std::stod(value);
+            } else if (arg == "--seed") {
+                options.seed = std::stoull(value);
+            } else {
+                throw std::runtime_error("Unknown option " + arg);
+            }
+        }
+        if (output.empty()) {
+            throw std::runtime_error("No output file");
+        }
+
+        SceneGenerator(options).Write(output);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n"
+                  << "Usage: " << argv[0]
+                  << " [--triangles N] [--spheres N] [--lights N] [--mirror F] [--refractive F]"
+                     " [--diffuse N] [--distribution uniform|clustered] [--clusters N]"
+                     " [--extent X] [--triangle-size X] [--sphere-radius X] [--seed N]"
+                     " <output .obj>\n";
+        return 1;
+    }
+    return 0;
+}
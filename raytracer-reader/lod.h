@@ -0,0 +1,384 @@
+#pragma once
+
+#include <object.h>
+#include <triangle.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+struct LodOptions {
+    // Meshes with fewer triangles are always rendered at full resolution.
+    size_t min_triangles = 64;
+    size_t max_levels = 4;
+    // Each level keeps this fraction of the previous level's triangles.
+    double reduction = 0.5;
+    // A level is used only if it has at least this many triangles per pixel the mesh covers...
+    double triangles_per_pixel = 1;
+    // ...and its simplification error stays below this many pixels.
+    double max_error_pixels = 0.5;
+};
+
+struct LodLevel {
+    std::vector<Object> objects;
+    // Upper bound on how far the simplified surface moved, in scene units.
+    double error;
+};
+
+// A run of objects with the same material and its simplified versions, coarsest last. Level 0
+// is the original run [first, first + count) of the scene's objects.
+struct LodMesh {
+    size_t first;
+    size_t count;
+    Vector center;
+    double radius;
+    std::vector<LodLevel> levels;
+};
+
+// Symmetric 4x4 matrix summing squared distances to a set of planes (Garland & Heckbert).
+class Quadric {
+public:
+    Quadric() : data_{} {
+    }
+
+    static Quadric FromPlane(const Vector& normal, double d, double weight = 1) {
+        const double p[4] = {normal[0], normal[1], normal[2], d};
+        Quadric quadric;
+        size_t k = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            for (size_t j = i; j < 4; ++j) {
+                quadric.data_[k++] = weight * p[i] * p[j];
+            }
+        }
+        return quadric;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        for (size_t i = 0; i < data_.size(); ++i) {
+            data_[i] += other.data_[i];
+        }
+        return *this;
+    }
+
+    double Evaluate(const Vector& v) const {
+        const double p[4] = {v[0], v[1], v[2], 1};
+        double result = 0;
+        size_t k = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            for (size_t j = i; j < 4; ++j) {
+                result += (i == j ? 1 : 2) * data_[k++] * p[i] * p[j];
+            }
+        }
+        return std::max(0., result);
+    }
+
+private:
+    std::array<double, 10> data_;
+};
+
+// Edge-collapse simplification of a single-material triangle soup. Vertices at the same
+// position are welded, and each collapse moves one endpoint onto the other, whichever is cheaper
+// under the summed quadrics. Collapses that would flip a triangle are rejected and boundary
+// edges are held in place by extra perpendicular planes. Simplified levels have no per-vertex
+// normals and shade flat.
+std::vector<LodLevel> SimplifyMesh(const Object* objects, size_t count,
+                                   const LodOptions& options) {
+    constexpr double kBoundaryWeight = 1000;
+
+    struct PositionHash {
+        size_t operator()(const std::array<double, 3>& p) const {
+            uint64_t hash = 0;
+            for (double value : p) {
+                uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                hash = hash * 0x9e3779b97f4a7c15 + bits;
+            }
+            return hash ^ (hash >> 29);
+        }
+    };
+
+    std::vector<Vector> positions;
+    std::unordered_map<std::array<double, 3>, int, PositionHash> position_ids;
+    std::vector<std::array<int, 3>> triangles;
+    for (size_t i = 0; i < count; ++i) {
+        std::array<int, 3> triangle;
+        for (size_t k = 0; k < 3; ++k) {
+            const auto& p = objects[i].polygon[k];
+            auto [it, inserted] =
+                position_ids.try_emplace({p[0], p[1], p[2]}, static_cast<int>(positions.size()));
+            if (inserted) {
+                positions.push_back(p);
+            }
+            triangle[k] = it->second;
+        }
+        if (triangle[0] != triangle[1] && triangle[1] != triangle[2] &&
+            triangle[0] != triangle[2]) {
+            triangles.push_back(triangle);
+        }
+    }
+
+    auto get_normal = [&](const std::array<int, 3>& t) {
+        return CrossProduct(positions[t[1]] - positions[t[0]], positions[t[2]] - positions[t[0]]);
+    };
+
+    std::vector<Quadric> quadrics(positions.size());
+    std::vector<std::vector<int>> vertex_triangles(positions.size());
+    std::unordered_map<uint64_t, int> edge_uses;
+    auto edge_key = [](int a, int b) {
+        return static_cast<uint64_t>(std::min(a, b)) << 32 | static_cast<uint32_t>(std::max(a, b));
+    };
+
+    for (size_t t = 0; t < triangles.size(); ++t) {
+        const auto& triangle = triangles[t];
+        auto normal = get_normal(triangle);
+        if (Length(normal) == 0) {
+            continue;
+        }
+        normal.Normalize();
+        auto plane = Quadric::FromPlane(normal, -DotProduct(normal, positions[triangle[0]]));
+        for (size_t k = 0; k < 3; ++k) {
+            quadrics[triangle[k]] += plane;
+            vertex_triangles[triangle[k]].push_back(t);
+            ++edge_uses[edge_key(triangle[k], triangle[(k + 1) % 3])];
+        }
+    }
+
+    for (const auto& triangle : triangles) {
+        auto normal = get_normal(triangle);
+        for (size_t k = 0; k < 3; ++k) {
+            int a = triangle[k], b = triangle[(k + 1) % 3];
+            if (edge_uses[edge_key(a, b)] != 1) {
+                continue;
+            }
+            auto edge = positions[b] - positions[a];
+            auto side = CrossProduct(edge, normal);
+            if (Length(side) == 0) {
+                continue;
+            }
+            side.Normalize();
+            auto plane = Quadric::FromPlane(side, -DotProduct(side, positions[a]),
+                                            kBoundaryWeight * DotProduct(edge, edge));
+            quadrics[a] += plane;
+            quadrics[b] += plane;
+        }
+    }
+
+    struct Collapse {
+        double cost;
+        int from;
+        int to;
+        uint32_t from_version;
+        uint32_t to_version;
+
+        bool operator<(const Collapse& other) const {
+            return cost > other.cost;
+        }
+    };
+
+    std::vector<uint32_t> versions(positions.size(), 0);
+    std::vector<bool> removed_vertices(positions.size(), false);
+    std::vector<bool> removed_triangles(triangles.size(), false);
+    std::priority_queue<Collapse> heap;
+
+    auto push_edge = [&](int a, int b) {
+        auto quadric = quadrics[a];
+        quadric += quadrics[b];
+        auto cost_to_a = quadric.Evaluate(positions[a]);
+        auto cost_to_b = quadric.Evaluate(positions[b]);
+        if (cost_to_b <= cost_to_a) {
+            heap.push({cost_to_b, a, b, versions[a], versions[b]});
+        } else {
+            heap.push({cost_to_a, b, a, versions[b], versions[a]});
+        }
+    };
+
+    for (const auto& triangle : triangles) {
+        for (size_t k = 0; k < 3; ++k) {
+            if (triangle[k] < triangle[(k + 1) % 3]) {
+                push_edge(triangle[k], triangle[(k + 1) % 3]);
+            }
+        }
+    }
+
+    auto make_level = [&](double error) {
+        LodLevel level{{}, std::sqrt(error)};
+        auto* material = objects[0].material;
+        for (size_t t = 0; t < triangles.size(); ++t) {
+            if (removed_triangles[t]) {
+                continue;
+            }
+            const auto& triangle = triangles[t];
+            level.objects.emplace_back(
+                Triangle{positions[triangle[0]], positions[triangle[1]], positions[triangle[2]]},
+                material, std::array<std::optional<Vector>, 3>{});
+        }
+        return level;
+    };
+
+    std::vector<LodLevel> levels;
+    size_t num_triangles = triangles.size();
+    double max_cost = 0;
+    auto target = static_cast<size_t>(num_triangles * options.reduction);
+
+    while (levels.size() < options.max_levels && !heap.empty()) {
+        auto collapse = heap.top();
+        heap.pop();
+
+        int from = collapse.from, to = collapse.to;
+        if (removed_vertices[from] || removed_vertices[to] ||
+            versions[from] != collapse.from_version || versions[to] != collapse.to_version) {
+            continue;
+        }
+
+        bool flips = false;
+        for (int t : vertex_triangles[from]) {
+            const auto& triangle = triangles[t];
+            if (removed_triangles[t] || std::find(triangle.begin(), triangle.end(), to) !=
+                                            triangle.end()) {
+                continue;
+            }
+            auto moved = triangle;
+            std::replace(moved.begin(), moved.end(), from, to);
+            if (DotProduct(get_normal(triangle), get_normal(moved)) <= 0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) {
+            continue;
+        }
+
+        for (int t : vertex_triangles[from]) {
+            auto& triangle = triangles[t];
+            if (removed_triangles[t]) {
+                continue;
+            }
+            if (std::find(triangle.begin(), triangle.end(), to) != triangle.end()) {
+                removed_triangles[t] = true;
+                --num_triangles;
+            } else {
+                std::replace(triangle.begin(), triangle.end(), from, to);
+                vertex_triangles[to].push_back(t);
+            }
+        }
+        removed_vertices[from] = true;
+        quadrics[to] += quadrics[from];
+        ++versions[to];
+        max_cost = std::max(max_cost, collapse.cost);
+
+        std::vector<int> neighbours;
+        for (int t : vertex_triangles[to]) {
+            if (!removed_triangles[t]) {
+                neighbours.insert(neighbours.end(), triangles[t].begin(), triangles[t].end());
+            }
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (int neighbour : neighbours) {
+            if (neighbour != to) {
+                push_edge(neighbour, to);
+            }
+        }
+
+        if (num_triangles <= target) {
+            levels.push_back(make_level(max_cost));
+            target = static_cast<size_t>(num_triangles * options.reduction);
+            if (target < 1) {
+                break;
+            }
+        }
+    }
+
+    return levels;
+}
+
+// Splits objects into runs of equal material and builds LOD levels for the large enough ones.
+std::vector<LodMesh> BuildLodMeshes(const std::vector<Object>& objects,
+                                    const LodOptions& options) {
+    std::vector<LodMesh> meshes;
+
+    for (size_t first = 0; first < objects.size();) {
+        auto last = first;
+        while (last < objects.size() && objects[last].material == objects[first].material) {
+            ++last;
+        }
+
+        LodMesh mesh{first, last - first, {}, 0, {}};
+        Vector min = objects[first].polygon[0], max = min;
+        for (auto i = first; i < last; ++i) {
+            for (size_t k = 0; k < 3; ++k) {
+                for (size_t axis = 0; axis < 3; ++axis) {
+                    min[axis] = std::min(min[axis], objects[i].polygon[k][axis]);
+                    max[axis] = std::max(max[axis], objects[i].polygon[k][axis]);
+                }
+            }
+        }
+        mesh.center = (min + max) / 2;
+        mesh.radius = Length(max - min) / 2;
+        if (mesh.count >= options.min_triangles) {
+            mesh.levels = SimplifyMesh(&objects[first], mesh.count, options);
+        }
+        meshes.push_back(std::move(mesh));
+
+        first = last;
+    }
+
+    return meshes;
+}
+
+// Scene seen from a camera whose pixels span pixel_angle radians, so that the LOD level of each
+// mesh can be picked per ray from its projected size.
+template <class SceneT>
+class LodSceneView {
+public:
+    LodSceneView(const SceneT& scene, double pixel_angle, const LodOptions& options)
+        : scene_(scene), pixel_angle_(pixel_angle), options_(options) {
+    }
+
+    const SceneT& GetScene() const {
+        return scene_;
+    }
+
+    const auto& GetSphereObjects() const {
+        return scene_.GetSphereObjects();
+    }
+
+    const auto& GetLights() const {
+        return scene_.GetLights();
+    }
+
+    // Coarsest level that still has about one triangle per covered pixel and whose error stays
+    // under a fraction of a pixel, both measured at the mesh's distance from origin.
+    const Object* SelectLevel(const LodMesh& mesh, const Vector& origin, size_t* count) const {
+        const auto& objects = scene_.GetObjects();
+        double distance = Length(mesh.center - origin);
+
+        if (distance > mesh.radius) {
+            double pixel_size = distance * pixel_angle_;
+            double projected_size = 2 * mesh.radius / pixel_size;
+            double min_triangles = options_.triangles_per_pixel * projected_size * projected_size;
+
+            for (auto level = mesh.levels.rbegin(); level != mesh.levels.rend(); ++level) {
+                if (level->objects.size() >= min_triangles &&
+                    level->error <= options_.max_error_pixels * pixel_size) {
+                    *count = level->objects.size();
+                    return level->objects.data();
+                }
+            }
+        }
+
+        *count = mesh.count;
+        return objects.data() + mesh.first;
+    }
+
+private:
+    const SceneT& scene_;
+    double pixel_angle_;
+    LodOptions options_;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <stdexcept>
+#include <utility>
+
+// A file mapped into memory, either created with a fixed size for writing or opened for
+// reading.
+class MappedFile {
+public:
+    static MappedFile Create(const std::filesystem::path& path, size_t size) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Can't create " + path.string());
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            close(fd);
+            throw std::runtime_error("Can't resize " + path.string());
+        }
+        return MappedFile(fd, size, PROT_READ | PROT_WRITE, path);
+    }
+
+    static MappedFile Open(const std::filesystem::path& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Can't open " + path.string());
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw std::runtime_error("Can't stat " + path.string());
+        }
+        return MappedFile(fd, info.st_size, PROT_READ, path);
+    }
+
+    MappedFile(MappedFile&& other)
+        : fd_(std::exchange(other.fd_, -1)),
+          size_(std::exchange(other.size_, 0)),
+          data_(std::exchange(other.data_, nullptr)) {
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(data_, size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    char* Data() {
+        return static_cast<char*>(data_);
+    }
+    const char* Data() const {
+        return static_cast<const char*>(data_);
+    }
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    MappedFile(int fd, size_t size, int protection, const std::filesystem::path& path)
+        : fd_(fd), size_(size) {
+        if (size_ == 0) {
+            return;
+        }
+        data_ = mmap(nullptr, size_, protection, MAP_SHARED, fd_, 0);
+        if (data_ == MAP_FAILED) {
+            data_ = nullptr;
+            close(fd_);
+            throw std::runtime_error("Can't map " + path.string());
+        }
+    }
+
+    int fd_;
+    size_t size_;
+    void* data_ = nullptr;
+};
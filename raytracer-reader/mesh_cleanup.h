@@ -0,0 +1,110 @@
+#pragma once
+
+#include <object.h>
+#include <vector.h>
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+struct MeshCleanupOptions {
+    // Vertices closer than this are welded into the first of them; zero welds only vertices at
+    // exactly the same position, which doesn't move any geometry.
+    double weld_tolerance = 0;
+    // Triangles with at most this area are dropped. GetIntersection() rejects every triangle of
+    // area below 0.5e-7 for unit ray directions, so the default doesn't change the image.
+    double min_area = 0.5e-7;
+};
+
+struct MeshCleanupReport {
+    size_t welded_vertices = 0;
+    size_t removed_triangles = 0;
+};
+
+// Maps every vertex to the index of the vertex it is welded into, which is itself for vertices
+// that are kept. Positions are hashed on a grid of tolerance-sized cells and compared against
+// the kept vertices of the 27 cells around them.
+std::vector<int> WeldVertices(const std::vector<Vector>& vertices, double tolerance) {
+    struct CellHash {
+        size_t operator()(const std::array<int64_t, 3>& cell) const {
+            uint64_t hash = 0;
+            for (auto value : cell) {
+                hash = hash * 0x9e3779b97f4a7c15 + static_cast<uint64_t>(value);
+            }
+            return hash ^ (hash >> 29);
+        }
+    };
+
+    // With no tolerance the cell is the bit pattern of the position, with -0 taken as 0.
+    auto get_cell = [tolerance](const Vector& p) {
+        std::array<int64_t, 3> cell;
+        for (size_t k = 0; k < 3; ++k) {
+            if (tolerance > 0) {
+                cell[k] = static_cast<int64_t>(std::floor(p[k] / tolerance));
+            } else {
+                double value = p[k] + 0.;
+                std::memcpy(&cell[k], &value, sizeof(value));
+            }
+        }
+        return cell;
+    };
+
+    std::vector<int> welded(vertices.size());
+    std::unordered_map<std::array<int64_t, 3>, std::vector<int>, CellHash> cells;
+    for (size_t i = 0; i < vertices.size(); ++i) {
+        auto cell = get_cell(vertices[i]);
+        welded[i] = static_cast<int>(i);
+
+        if (tolerance <= 0) {
+            auto [it, inserted] = cells.try_emplace(cell, std::vector<int>{welded[i]});
+            welded[i] = it->second.front();
+            continue;
+        }
+
+        bool found = false;
+        for (int64_t dx = -1; dx <= 1 && !found; ++dx) {
+            for (int64_t dy = -1; dy <= 1 && !found; ++dy) {
+                for (int64_t dz = -1; dz <= 1 && !found; ++dz) {
+                    auto it = cells.find({cell[0] + dx, cell[1] + dy, cell[2] + dz});
+                    if (it == cells.end()) {
+                        continue;
+                    }
+                    for (int kept : it->second) {
+                        if (Length(vertices[kept] - vertices[i]) <= tolerance) {
+                            welded[i] = kept;
+                            found = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        if (!found) {
+            cells[cell].push_back(welded[i]);
+        }
+    }
+    return welded;
+}
+
+// Removes triangles of at most min_area, keeping the order of the others. Returns the number
+// of triangles removed.
+size_t RemoveDegenerateTriangles(std::vector<Object>* objects, double min_area) {
+    auto size = objects->size();
+    std::vector<Object> kept;
+    kept.reserve(size);
+    for (const auto& object : *objects) {
+        if (object.polygon.Area() > min_area) {
+            kept.push_back(object);
+        }
+    }
+    if (kept.size() == size) {
+        return 0;
+    }
+    kept.shrink_to_fit();
+    // Triangle has const members, so the vector is rebuilt rather than compacted in place.
+    objects->swap(kept);
+    return size - objects->size();
+}
@@ -21,10 +21,11 @@ Light ReadLight(std::istringstream& input) {
     return Light(Vector(x, y, z), Vector(r, g, b));
 }
 
-std::vector<std::tuple<std::optional<int>, std::optional<int>, std::optional<int>>> ReadF(
-    std::istringstream& input) {
+using FaceIndices = std::tuple<std::optional<int>, std::optional<int>, std::optional<int>>;
 
-    std::vector<std::tuple<std::optional<int>, std::optional<int>, std::optional<int>>> result;
+// Fills result with the face's v/vt/vn triples, reusing its storage between calls.
+void ReadF(std::istringstream& input, std::vector<FaceIndices>* result) {
+    result->clear();
 
     std::string a, b, c;
 
@@ -46,8 +47,6 @@ std::vector<std::tuple<std::optional<int>, std::optional<int>, std::optional<int
             c_opt = std::stoi(c);
         }
 
-        result.emplace_back(std::stoi(a), b_opt, c_opt);
+        result->emplace_back(std::stoi(a), b_opt, c_opt);
     }
-
-    return result;
-}
\ No newline at end of file
+}
@@ -1,20 +1,20 @@
 #pragma once
 
 #include <triangle.h>
+#include <polygon.h>
 #include <material.h>
 #include <sphere.h>
 #include <vector.h>
 #include <vector>
 #include <optional>
+#include <array>
+#include <cstdint>
 
 struct Object {
 
-    Object(Triangle& polygon, Material* material, std::vector<std::optional<Vector>>& normals)
-        : polygon(polygon), material(material) {
-
-        for (size_t i = 0; i < 3; ++i) {
-            normals_[i] = normals[i];
-        }
+    Object(const Triangle& polygon, Material* material,
+           const std::array<std::optional<Vector>, 3>& normals)
+        : polygon(polygon), material(material), normals_(normals) {
     }
 
     Triangle polygon;
@@ -30,7 +30,42 @@ struct Object {
     }
 
 private:
-    std::optional<Vector> normals_[3];
+    std::array<std::optional<Vector>, 3> normals_;
+};
+
+// A face with more than three vertices, kept whole instead of fan-triangulated. Like a face of
+// the loader, it is a run in a shared index array: num_vertices indices into the polygon
+// vertices starting at first_index, followed by as many into the polygon normals if every vertex
+// has one. See PolygonPool.
+struct PolygonObject {
+    Material* material;
+    Vector normal;
+    uint32_t first_index;
+    uint32_t num_vertices;
+    bool has_normals;
+
+    bool NormalExists() const {
+        return has_normals;
+    }
+};
+
+// The native polygons of a scene and the flat arrays they index. A vertex or normal shared by
+// several faces in the .obj file is stored once.
+struct PolygonPool {
+    std::vector<PolygonObject> objects;
+    std::vector<Vector> vertices;
+    std::vector<Vector> normals;
+    std::vector<uint32_t> indices;
+
+    ConvexPolygon GetPolygon(const PolygonObject& object) const {
+        return ConvexPolygon(vertices.data(), indices.data() + object.first_index,
+                             object.num_vertices, object.normal);
+    }
+
+    // Normal at the k-th vertex; the object must have normals.
+    const Vector& GetNormal(const PolygonObject& object, size_t k) const {
+        return normals[indices[object.first_index + object.num_vertices + k]];
+    }
 };
 
 struct SphereObject {
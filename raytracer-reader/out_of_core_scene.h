@@ -0,0 +1,594 @@
+#pragma once
+
+#include <scene.h>
+#include <mapped_file.h>
+#include <bounding_box.h>
+#include <morton.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+// On-disk layout of a cluster file:
+//
+//   magic, offset of the metadata block
+//   clusters: runs of PackedTriangle, each run sorted along a Morton curve of the centroids
+//   metadata: material library path, material names, spheres, lights, cluster table
+//
+// Everything except the triangles is small and stays resident; triangles are paged in one
+// cluster at a time.
+constexpr char kClusterFileMagic[8] = {'R', 'T', 'C', 'L', 'S', 'T', '0', '1'};
+
+struct PackedTriangle {
+    double vertices[3][3];
+    double normals[3][3];
+    uint32_t material_id;
+    uint32_t has_normals;
+};
+
+struct ClusterInfo {
+    BoundingBox bounds;
+    uint64_t offset;
+    uint64_t num_triangles;
+};
+
+// A node of the hierarchy over the cluster bounds. A leaf holds the single cluster first; an
+// inner node has the children first and first + 1.
+struct ClusterNode {
+    BoundingBox bounds;
+    uint32_t first;
+    bool is_leaf;
+};
+
+template <class T>
+void WriteBinary(std::ostream& os, const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    os.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteBinary(std::ostream& os, const std::string& value) {
+    WriteBinary(os, static_cast<uint64_t>(value.size()));
+    os.write(value.data(), value.size());
+}
+
+void WriteBinary(std::ostream& os, const Vector& value) {
+    for (size_t i = 0; i < 3; ++i) {
+        WriteBinary(os, value[i]);
+    }
+}
+
+template <class T>
+T ReadBinary(std::istream& is) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    if (!is.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw std::runtime_error("Truncated cluster file");
+    }
+    return value;
+}
+
+template <>
+std::string ReadBinary<std::string>(std::istream& is) {
+    auto size = ReadBinary<uint64_t>(is);
+    std::string value(size, '\0');
+    if (!is.read(value.data(), size)) {
+        throw std::runtime_error("Truncated cluster file");
+    }
+    return value;
+}
+
+template <>
+Vector ReadBinary<Vector>(std::istream& is) {
+    Vector value;
+    for (size_t i = 0; i < 3; ++i) {
+        value[i] = ReadBinary<double>(is);
+    }
+    return value;
+}
+
+// Parses the .obj file one chunk of about chunk_bytes of whole lines at a time and hands each
+// chunk to f with its vertex and normal indices made absolute and its material ids global in
+// material_names, as ReadObjFile() merges them. Only one chunk and its text are held at once.
+template <class F>
+void ForEachObjChunk(const std::filesystem::path& path, size_t chunk_bytes,
+                     MaterialNameTable* material_names, F f) {
+    std::ifstream is{path, std::ios::binary};
+    if (!is) {
+        throw std::runtime_error("Can't read " + path.string());
+    }
+    int curr_material_id = material_names->Intern("");
+    size_t num_vertices = 0, num_normals = 0;
+
+    std::string text;
+    std::vector<char> buffer(chunk_bytes);
+    for (bool last = false; !last;) {
+        is.read(buffer.data(), buffer.size());
+        text.append(buffer.data(), is.gcount());
+        last = !is;
+        auto end = last ? text.size() : text.rfind('\n') + 1;
+        if (end == 0) {
+            continue;
+        }
+        auto chunk = ParseObjChunk(std::string_view(text).substr(0, end));
+        text.erase(0, end);
+
+        std::vector<int> global_ids;
+        for (const auto& name : chunk.material_names.GetNames()) {
+            global_ids.push_back(material_names->Intern(name));
+        }
+        auto to_global = [&](int material_id) {
+            if (material_id == ObjChunk::kInheritedMaterial) {
+                return curr_material_id;
+            }
+            return global_ids[material_id];
+        };
+
+        for (auto point_idx : chunk.relative_vertex_points) {
+            chunk.points[point_idx].v_idx += num_vertices;
+        }
+        for (auto point_idx : chunk.relative_normal_points) {
+            chunk.points[point_idx].vn_idx.value() += num_normals;
+        }
+        for (auto& obj_meta : chunk.objs) {
+            obj_meta.material_id = to_global(obj_meta.material_id);
+        }
+        for (auto& obj_meta : chunk.sphere_objects) {
+            obj_meta.material_id = to_global(obj_meta.material_id);
+        }
+        curr_material_id = to_global(chunk.last_material_id);
+        num_vertices += chunk.vertices.size();
+        num_normals += chunk.normals.size();
+
+        f(chunk);
+    }
+}
+
+// The index-th of the vectors written to the file with WriteBinary().
+Vector GetSpilledVector(const MappedFile& file, int index) {
+    constexpr size_t kSize = 3 * sizeof(double);
+    if (index < 0 || (index + 1) * kSize > file.Size()) {
+        throw std::runtime_error("Bad vertex index");
+    }
+    double coords[3];
+    std::memcpy(coords, file.Data() + index * kSize, kSize);
+    return {coords[0], coords[1], coords[2]};
+}
+
+// A triangle on its way to a cluster, with the Morton code it is sorted by.
+struct SpilledTriangle {
+    uint64_t code;
+    PackedTriangle triangle;
+};
+
+// Converts an .obj scene into a cluster file of at most cluster_size triangles per cluster, in
+// memory bounded by about memory_budget bytes whatever the size of the scene:
+//
+//   1. The file is read in chunks. Vertices and normals are spilled to files that are mapped
+//      back for lookups, and only their bounds, the triangle count, spheres, lights and
+//      material names are kept.
+//   2. The file is read again, and each triangle is appended to a spill file chosen by the
+//      leading bits of the Morton code of its centroid, with enough files that each holds
+//      about memory_budget bytes.
+//   3. The spill files are sorted one at a time, in code order, and cut into clusters.
+//
+// The clusters are the same as if all triangles had been sorted at once. Only a spill file
+// that is much larger than the budget, for triangles crowded into one Morton cell, exceeds it.
+void WriteClusterFile(const std::filesystem::path& obj_path,
+                      const std::filesystem::path& cluster_path, size_t cluster_size = 1024,
+                      size_t memory_budget = size_t{256} << 20) {
+    TraceScope trace("WriteClusterFile");
+    constexpr size_t kMaxSpillFiles = 256;
+    const size_t chunk_bytes = std::clamp<size_t>(memory_budget / 8, 1 << 10, 16 << 20);
+
+    auto spill_dir = cluster_path;
+    spill_dir += ".spill";
+    std::filesystem::create_directories(spill_dir);
+    struct SpillDirRemover {
+        std::filesystem::path path;
+        ~SpillDirRemover() {
+            std::error_code error;
+            std::filesystem::remove_all(path, error);
+        }
+    } remover{spill_dir};
+
+    MaterialNameTable material_names;
+    std::string material_file_name;
+    std::vector<SphereObjectMeta> sphere_objects;
+    std::vector<LightObjectMeta> lights;
+    BoundingBox bounds;
+    uint64_t num_triangles = 0;
+    {
+        std::ofstream vertices_os{spill_dir / "vertices", std::ios::binary};
+        std::ofstream normals_os{spill_dir / "normals", std::ios::binary};
+        ForEachObjChunk(obj_path, chunk_bytes, &material_names, [&](const ObjChunk& chunk) {
+            for (const auto& vertex : chunk.vertices) {
+                bounds.Extend(vertex);
+                WriteBinary(vertices_os, vertex);
+            }
+            for (const auto& normal : chunk.normals) {
+                WriteBinary(normals_os, normal);
+            }
+            for (const auto& obj_meta : chunk.objs) {
+                num_triangles += obj_meta.num_points > 2 ? obj_meta.num_points - 2 : 0;
+            }
+            for (const auto& obj_meta : chunk.sphere_objects) {
+                sphere_objects.push_back(obj_meta);
+            }
+            lights.insert(lights.end(), chunk.lights.begin(), chunk.lights.end());
+            if (chunk.material_file_name) {
+                material_file_name = chunk.material_file_name.value();
+            }
+        });
+        if (!vertices_os.flush() || !normals_os.flush()) {
+            throw std::runtime_error("Can't write " + spill_dir.string());
+        }
+    }
+    auto vertices = MappedFile::Open(spill_dir / "vertices");
+    auto normals = MappedFile::Open(spill_dir / "normals");
+
+    size_t bucket_bits = 0;
+    while ((size_t{1} << bucket_bits) < kMaxSpillFiles &&
+           (memory_budget << bucket_bits) < num_triangles * sizeof(SpilledTriangle)) {
+        ++bucket_bits;
+    }
+    auto get_bucket_path = [&](size_t bucket) {
+        return spill_dir / ("triangles" + std::to_string(bucket));
+    };
+    {
+        std::vector<std::ofstream> buckets;
+        for (size_t bucket = 0; bucket < (size_t{1} << bucket_bits); ++bucket) {
+            buckets.emplace_back(get_bucket_path(bucket), std::ios::binary);
+        }
+        MaterialNameTable names;
+        ForEachObjChunk(obj_path, chunk_bytes, &names, [&](const ObjChunk& chunk) {
+            for (const auto& obj_meta : chunk.objs) {
+                const auto* face = chunk.points.data() + obj_meta.first_point;
+                for (size_t corner = 1; corner + 1 < obj_meta.num_points; ++corner) {
+                    const ObjPoint* triangle_points[] = {&face[0], &face[corner],
+                                                         &face[corner + 1]};
+                    SpilledTriangle spilled;
+                    std::memset(&spilled, 0, sizeof(spilled));
+                    auto& triangle = spilled.triangle;
+                    triangle.material_id = obj_meta.material_id;
+                    Vector centroid;
+                    for (size_t k = 0; k < 3; ++k) {
+                        auto vertex = GetSpilledVector(vertices, triangle_points[k]->v_idx);
+                        centroid = centroid + vertex / 3;
+                        for (size_t axis = 0; axis < 3; ++axis) {
+                            triangle.vertices[k][axis] = vertex[axis];
+                        }
+                        if (triangle_points[k]->vn_idx) {
+                            auto normal =
+                                GetSpilledVector(normals, triangle_points[k]->vn_idx.value());
+                            for (size_t axis = 0; axis < 3; ++axis) {
+                                triangle.normals[k][axis] = normal[axis];
+                            }
+                            triangle.has_normals |= 1u << k;
+                        }
+                    }
+                    // Morton codes have 63 bits.
+                    spilled.code = GetMortonCode(centroid, bounds);
+                    WriteBinary(buckets[spilled.code >> (63 - bucket_bits)], spilled);
+                }
+            }
+        });
+        for (auto& bucket : buckets) {
+            if (!bucket.flush()) {
+                throw std::runtime_error("Can't write " + spill_dir.string());
+            }
+        }
+    }
+
+    std::ofstream os{cluster_path, std::ios::binary};
+    if (!os) {
+        throw std::runtime_error("Can't write " + cluster_path.string());
+    }
+    os.write(kClusterFileMagic, sizeof(kClusterFileMagic));
+    WriteBinary(os, uint64_t{0});
+
+    std::vector<ClusterInfo> clusters;
+    auto write_cluster = [&](const SpilledTriangle* triangles, size_t count) {
+        ClusterInfo cluster{{}, static_cast<uint64_t>(os.tellp()), count};
+        for (size_t i = 0; i < count; ++i) {
+            for (const auto& vertex : triangles[i].triangle.vertices) {
+                cluster.bounds.Extend({vertex[0], vertex[1], vertex[2]});
+            }
+            WriteBinary(os, triangles[i].triangle);
+        }
+        clusters.push_back(cluster);
+    };
+
+    // Triangles left over from the previous spill file are carried into the next one, so that
+    // clusters run across files as they would through one sorted array.
+    std::vector<SpilledTriangle> pending;
+    for (size_t bucket = 0; bucket < (size_t{1} << bucket_bits); ++bucket) {
+        auto path = get_bucket_path(bucket);
+        auto carried = pending.size();
+        pending.resize(carried + std::filesystem::file_size(path) / sizeof(SpilledTriangle));
+        std::ifstream is{path, std::ios::binary};
+        auto bytes = (pending.size() - carried) * sizeof(SpilledTriangle);
+        if (!is.read(reinterpret_cast<char*>(pending.data() + carried), bytes)) {
+            throw std::runtime_error("Can't read " + path.string());
+        }
+        is.close();
+        std::filesystem::remove(path);
+
+        std::stable_sort(pending.begin() + carried, pending.end(),
+                         [](const SpilledTriangle& lhs, const SpilledTriangle& rhs) {
+                             return lhs.code < rhs.code;
+                         });
+        size_t begin = 0;
+        for (; pending.size() - begin >= cluster_size; begin += cluster_size) {
+            write_cluster(pending.data() + begin, cluster_size);
+        }
+        pending.erase(pending.begin(), pending.begin() + begin);
+    }
+    if (!pending.empty()) {
+        write_cluster(pending.data(), pending.size());
+    }
+
+    uint64_t metadata_offset = os.tellp();
+    auto material_path = obj_path.parent_path() / material_file_name;
+    WriteBinary(os, std::filesystem::absolute(material_path).string());
+
+    WriteBinary(os, static_cast<uint64_t>(material_names.GetNames().size()));
+    for (const auto& name : material_names.GetNames()) {
+        WriteBinary(os, name);
+    }
+
+    WriteBinary(os, static_cast<uint64_t>(sphere_objects.size()));
+    for (const auto& obj_meta : sphere_objects) {
+        WriteBinary(os, obj_meta.sphere.GetCenter());
+        WriteBinary(os, obj_meta.sphere.GetRadius());
+        WriteBinary(os, static_cast<uint32_t>(obj_meta.material_id));
+    }
+
+    WriteBinary(os, static_cast<uint64_t>(lights.size()));
+    for (const auto& light_meta : lights) {
+        WriteBinary(os, light_meta.light.position);
+        WriteBinary(os, light_meta.light.intensity);
+    }
+
+    WriteBinary(os, static_cast<uint64_t>(clusters.size()));
+    for (const auto& cluster : clusters) {
+        WriteBinary(os, cluster.bounds.GetMin());
+        WriteBinary(os, cluster.bounds.GetMax());
+        WriteBinary(os, cluster.offset);
+        WriteBinary(os, cluster.num_triangles);
+    }
+
+    os.seekp(sizeof(kClusterFileMagic));
+    WriteBinary(os, metadata_offset);
+    if (!os) {
+        throw std::runtime_error("Can't write " + cluster_path.string());
+    }
+}
+
+struct PagingStats {
+    size_t page_ins = 0;
+    size_t evictions = 0;
+    size_t resident_bytes = 0;
+    size_t peak_resident_bytes = 0;
+};
+
+// Scene whose triangles live in a cluster file and are paged in through an LRU cache bounded
+// by memory_budget bytes. Clusters in use by a ray stay alive until it's done with them, even
+// if they have been evicted meanwhile.
+class OutOfCoreScene {
+public:
+    using Cluster = std::vector<Object>;
+
+    OutOfCoreScene(const std::filesystem::path& cluster_path, size_t memory_budget)
+        : memory_budget_(memory_budget) {
+
+        std::ifstream is{cluster_path, std::ios::binary};
+        char magic[sizeof(kClusterFileMagic)];
+        if (!is.read(magic, sizeof(magic)) ||
+            std::memcmp(magic, kClusterFileMagic, sizeof(magic)) != 0) {
+            throw std::runtime_error("Not a cluster file: " + cluster_path.string());
+        }
+        is.seekg(ReadBinary<uint64_t>(is));
+
+        materials_ = ReadMaterials(ReadBinary<std::string>(is));
+
+        material_names_.resize(ReadBinary<uint64_t>(is));
+        for (auto& name : material_names_) {
+            name = ReadBinary<std::string>(is);
+        }
+        MaterialResolver resolver(material_names_, materials_);
+        for (const auto& name : material_names_) {
+            materials_by_id_.push_back(materials_.contains(name) ? &materials_.at(name) : nullptr);
+        }
+
+        auto num_spheres = ReadBinary<uint64_t>(is);
+        for (uint64_t i = 0; i < num_spheres; ++i) {
+            auto center = ReadBinary<Vector>(is);
+            auto radius = ReadBinary<double>(is);
+            auto material_id = ReadBinary<uint32_t>(is);
+            sphere_objects_.emplace_back(resolver.Get(material_id), Sphere{center, radius});
+        }
+
+        auto num_lights = ReadBinary<uint64_t>(is);
+        for (uint64_t i = 0; i < num_lights; ++i) {
+            auto position = ReadBinary<Vector>(is);
+            auto intensity = ReadBinary<Vector>(is);
+            lights_.push_back({position, intensity});
+        }
+
+        auto num_clusters = ReadBinary<uint64_t>(is);
+        for (uint64_t i = 0; i < num_clusters; ++i) {
+            auto min = ReadBinary<Vector>(is);
+            auto max = ReadBinary<Vector>(is);
+            auto offset = ReadBinary<uint64_t>(is);
+            auto num_triangles = ReadBinary<uint64_t>(is);
+            clusters_.push_back({{min, max}, offset, num_triangles});
+        }
+        if (!clusters_.empty()) {
+            nodes_.resize(1);
+            BuildNode(0, 0, clusters_.size());
+        }
+
+        fd_ = open(cluster_path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            throw std::runtime_error("Can't open " + cluster_path.string());
+        }
+    }
+
+    OutOfCoreScene(const OutOfCoreScene&) = delete;
+    OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+    ~OutOfCoreScene() {
+        close(fd_);
+    }
+
+    const std::vector<ClusterInfo>& GetClusters() const {
+        return clusters_;
+    }
+
+    // Root first, or empty if there are no clusters.
+    const std::vector<ClusterNode>& GetClusterNodes() const {
+        return nodes_;
+    }
+
+    std::shared_ptr<const Cluster> GetCluster(size_t index) const {
+        {
+            std::lock_guard lock(mutex_);
+            auto it = index_.find(index);
+            if (it != index_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->cluster;
+            }
+        }
+
+        auto cluster = LoadCluster(clusters_[index]);
+        auto bytes = sizeof(Cluster) + cluster->capacity() * sizeof(Object);
+
+        std::lock_guard lock(mutex_);
+        auto it = index_.find(index);
+        if (it != index_.end()) {
+            return it->second->cluster;
+        }
+        lru_.push_front({index, cluster, bytes});
+        index_[index] = lru_.begin();
+        ++stats_.page_ins;
+        stats_.resident_bytes += bytes;
+        stats_.peak_resident_bytes = std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+
+        while (stats_.resident_bytes > memory_budget_ && lru_.size() > 1) {
+            auto& victim = lru_.back();
+            stats_.resident_bytes -= victim.bytes;
+            ++stats_.evictions;
+            index_.erase(victim.index);
+            lru_.pop_back();
+        }
+        return cluster;
+    }
+
+    const std::vector<SphereObject>& GetSphereObjects() const {
+        return sphere_objects_;
+    }
+
+    const std::vector<Light>& GetLights() const {
+        return lights_;
+    }
+
+    const std::unordered_map<std::string, Material>& GetMaterials() const {
+        return materials_;
+    }
+
+    PagingStats GetStats() const {
+        std::lock_guard lock(mutex_);
+        return stats_;
+    }
+
+private:
+    struct Entry {
+        size_t index;
+        std::shared_ptr<const Cluster> cluster;
+        size_t bytes;
+    };
+
+    // Clusters are in Morton order, so halving a run of them splits space as well.
+    void BuildNode(size_t node, size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            nodes_[node].bounds.Extend(clusters_[i].bounds);
+        }
+        if (end - begin == 1) {
+            nodes_[node].first = begin;
+            nodes_[node].is_leaf = true;
+            return;
+        }
+        auto children = nodes_.size();
+        nodes_.resize(children + 2);
+        nodes_[node].first = children;
+        nodes_[node].is_leaf = false;
+        auto middle = begin + (end - begin) / 2;
+        BuildNode(children, begin, middle);
+        BuildNode(children + 1, middle, end);
+    }
+
+    std::shared_ptr<const Cluster> LoadCluster(const ClusterInfo& info) const {
+        std::vector<PackedTriangle> packed(info.num_triangles);
+        auto size = packed.size() * sizeof(PackedTriangle);
+        auto* data = reinterpret_cast<char*>(packed.data());
+        for (size_t done = 0; done < size;) {
+            auto read = pread(fd_, data + done, size - done, info.offset + done);
+            if (read <= 0) {
+                throw std::runtime_error("Can't read cluster");
+            }
+            done += read;
+        }
+
+        auto cluster = std::make_shared<Cluster>();
+        cluster->reserve(packed.size());
+        for (const auto& triangle : packed) {
+            std::array<Vector, 3> vertices;
+            std::array<std::optional<Vector>, 3> normals;
+            for (size_t k = 0; k < 3; ++k) {
+                const auto* v = triangle.vertices[k];
+                vertices[k] = {v[0], v[1], v[2]};
+                if (triangle.has_normals & (1u << k)) {
+                    const auto* n = triangle.normals[k];
+                    normals[k] = Vector{n[0], n[1], n[2]};
+                }
+            }
+            auto* material = materials_by_id_.at(triangle.material_id);
+            if (!material) {
+                throw std::runtime_error("Unknown material " +
+                                         material_names_[triangle.material_id]);
+            }
+            cluster->emplace_back(Triangle{vertices[0], vertices[1], vertices[2]}, material,
+                                  normals);
+        }
+        return cluster;
+    }
+
+    size_t memory_budget_;
+    int fd_ = -1;
+
+    std::unordered_map<std::string, Material> materials_;
+    std::vector<std::string> material_names_;
+    std::vector<Material*> materials_by_id_;
+    std::vector<SphereObject> sphere_objects_;
+    std::vector<Light> lights_;
+    std::vector<ClusterInfo> clusters_;
+    std::vector<ClusterNode> nodes_;
+
+    mutable std::mutex mutex_;
+    mutable std::list<Entry> lru_;
+    mutable std::unordered_map<size_t, std::list<Entry>::iterator> index_;
+    mutable PagingStats stats_;
+};
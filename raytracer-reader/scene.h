@@ -4,6 +4,11 @@
 #include <vector.h>
 #include <object.h>
 #include <light.h>
+#include <lod.h>
+#include <mesh_cleanup.h>
+#include <scene_memory.h>
+#include <spatial_sort.h>
+#include <trace_recorder.h>
 
 #include <vector>
 #include <unordered_map>
@@ -14,6 +19,15 @@
 #include <obj_reader.h>
 #include <type_reader.h>
 #include <optional>
+#include <array>
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <string_view>
+#include <thread>
+#include <cstdint>
+#include <limits>
+
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path&);
 
 struct ObjPoint {
@@ -21,13 +35,16 @@ struct ObjPoint {
     std::optional<int> vn_idx;
 };
 
+// A face refers to a run of num_points entries in the loader's shared point pool, so reading
+// a face doesn't allocate. Material ids index the interned material name table.
 struct ObjectMeta {
-    std::string material_name;
-    std::vector<ObjPoint> points;
+    int material_id;
+    size_t first_point;
+    size_t num_points;
 };
 
 struct SphereObjectMeta {
-    std::string material_name;
+    int material_id;
     Sphere sphere;
 };
 
@@ -42,50 +59,139 @@ int GetIndex(int idx, int size) {
     return idx - 1;
 }
 
-std::vector<Object> CreateObjects(std::vector<Vector>& vertices, std::vector<Vector>& normals,
-                                  std::unordered_map<std::string, Material>& materials,
-                                  std::vector<ObjectMeta>& objs) {
+// Resolves interned material ids lazily, so unknown names only fail if a face actually uses them.
+class MaterialResolver {
+public:
+    MaterialResolver(const std::vector<std::string>& material_names,
+                     std::unordered_map<std::string, Material>& materials)
+        : material_names_(material_names),
+          materials_(materials),
+          resolved_(material_names.size(), nullptr) {
+    }
+
+    Material* Get(int material_id) {
+        auto& material = resolved_[material_id];
+        if (!material) {
+            material = &materials_.at(material_names_[material_id]);
+        }
+        return material;
+    }
+
+private:
+    const std::vector<std::string>& material_names_;
+    std::unordered_map<std::string, Material>& materials_;
+    std::vector<Material*> resolved_;
+};
+
+// Faces are fan-triangulated, except that planar convex faces with more than three vertices go
+// to polygons whole if it is given.
+std::vector<Object> CreateObjects(const std::vector<Vector>& vertices,
+                                  const std::vector<Vector>& normals,
+                                  const std::vector<ObjPoint>& points, MaterialResolver& resolver,
+                                  const std::vector<ObjectMeta>& objs,
+                                  PolygonPool* polygons = nullptr) {
+
+    size_t num_triangles = 0;
+    for (const auto& obj_meta : objs) {
+        if (obj_meta.num_points > 2) {
+            num_triangles += obj_meta.num_points - 2;
+        }
+    }
 
     std::vector<Object> objects;
+    objects.reserve(num_triangles);
+
+    // Where each vertex and normal of the file went in the polygon pool, once a polygon uses it.
+    constexpr auto kNoSlot = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> vertex_slots;
+    std::vector<uint32_t> normal_slots;
+    if (polygons) {
+        vertex_slots.assign(vertices.size(), kNoSlot);
+        normal_slots.assign(normals.size(), kNoSlot);
+    }
+    auto add_index = [polygons](std::vector<uint32_t>& slots, std::vector<Vector>& pool,
+                                const std::vector<Vector>& values, int index) {
+        auto& slot = slots[index];
+        if (slot == kNoSlot) {
+            slot = pool.size();
+            pool.push_back(values[index]);
+        }
+        polygons->indices.push_back(slot);
+    };
+    std::vector<Vector> polygon_vertices;
 
-    for (auto& obj_meta : objs) {
-        for (size_t i = 1; i < obj_meta.points.size() - 1; ++i) {
-            std::vector<Vector> polygon_vertices;
-            std::vector<std::optional<Vector>> polygon_normals;
+    for (const auto& obj_meta : objs) {
+        if (obj_meta.num_points < 3) {
+            continue;
+        }
+        const auto* face = points.data() + obj_meta.first_point;
+        auto* material = resolver.Get(obj_meta.material_id);
+
+        // Faces that would overflow the 32-bit indices of the pool are triangulated.
+        if (polygons && obj_meta.num_points > 3 &&
+            polygons->indices.size() + 2 * obj_meta.num_points < kNoSlot) {
+            polygon_vertices.clear();
+            bool has_normals = true;
+            for (size_t i = 0; i < obj_meta.num_points; ++i) {
+                polygon_vertices.push_back(vertices[face[i].v_idx]);
+                has_normals = has_normals && face[i].vn_idx.has_value();
+            }
+            if (IsConvexPolygon(polygon_vertices)) {
+                PolygonObject polygon{material, GetAreaNormal(polygon_vertices).Normalized(),
+                                      static_cast<uint32_t>(polygons->indices.size()),
+                                      static_cast<uint32_t>(obj_meta.num_points), has_normals};
+                for (size_t i = 0; i < obj_meta.num_points; ++i) {
+                    add_index(vertex_slots, polygons->vertices, vertices, face[i].v_idx);
+                }
+                for (size_t i = 0; has_normals && i < obj_meta.num_points; ++i) {
+                    add_index(normal_slots, polygons->normals, normals, face[i].vn_idx.value());
+                }
+                polygons->objects.push_back(polygon);
+                continue;
+            }
+        }
 
-            std::vector<ObjPoint> points = {obj_meta.points[0], obj_meta.points[i],
-                                            obj_meta.points[i + 1]};
+        for (size_t i = 1; i + 1 < obj_meta.num_points; ++i) {
+            const ObjPoint* triangle_points[] = {&face[0], &face[i], &face[i + 1]};
 
+            std::array<std::optional<Vector>, 3> polygon_normals;
             for (size_t j = 0; j < 3; ++j) {
-                polygon_vertices.push_back(vertices[points[j].v_idx]);
-                if (points[j].vn_idx) {
-                    polygon_normals.push_back(normals[points[j].vn_idx.value()]);
-                } else {
-                    polygon_normals.push_back(std::nullopt);
+                if (triangle_points[j]->vn_idx) {
+                    polygon_normals[j] = normals[triangle_points[j]->vn_idx.value()];
                 }
             }
-            auto polygon = Triangle{polygon_vertices[0], polygon_vertices[1], polygon_vertices[2]};
-            objects.emplace_back(polygon, &materials.at(obj_meta.material_name), polygon_normals);
+            objects.emplace_back(Triangle{vertices[triangle_points[0]->v_idx],
+                                          vertices[triangle_points[1]->v_idx],
+                                          vertices[triangle_points[2]->v_idx]},
+                                 material, polygon_normals);
         }
     }
 
+    if (polygons) {
+        objects.shrink_to_fit();
+        polygons->objects.shrink_to_fit();
+        polygons->vertices.shrink_to_fit();
+        polygons->normals.shrink_to_fit();
+        polygons->indices.shrink_to_fit();
+    }
     return objects;
 }
 
-std::vector<SphereObject> CreateSphereObjects(
-    std::vector<SphereObjectMeta>& sphere_objects,
-    std::unordered_map<std::string, Material>& materials) {
+std::vector<SphereObject> CreateSphereObjects(const std::vector<SphereObjectMeta>& sphere_objects,
+                                              MaterialResolver& resolver) {
     std::vector<SphereObject> objects;
+    objects.reserve(sphere_objects.size());
 
-    for (auto& obj_meta : sphere_objects) {
-        objects.emplace_back(&materials.at(obj_meta.material_name), obj_meta.sphere);
+    for (const auto& obj_meta : sphere_objects) {
+        objects.emplace_back(resolver.Get(obj_meta.material_id), obj_meta.sphere);
     }
 
     return objects;
 }
 
-std::vector<Light> CreateLights(std::vector<LightObjectMeta>& light_objects) {
+std::vector<Light> CreateLights(const std::vector<LightObjectMeta>& light_objects) {
     std::vector<Light> lights;
+    lights.reserve(light_objects.size());
 
     for (auto& obj_meta : light_objects) {
         lights.push_back(obj_meta.light);
@@ -106,35 +212,132 @@ public:
         return sphere_objects_;
     }
 
+    // Empty unless the scene was read with native polygons.
+    const std::vector<PolygonObject>& GetPolygonObjects() const {
+        return polygons_.objects;
+    }
+
+    // The polygon objects with the vertices and normals they index.
+    const PolygonPool& GetPolygonPool() const {
+        return polygons_;
+    }
+
     const std::vector<Light>& GetLights() const {
         return lights_;
     }
 
+    // Lights and materials can be edited in place; objects keep pointing to the same materials.
+    std::vector<Light>& GetLights() {
+        return lights_;
+    }
+
+    std::unordered_map<std::string, Material>& GetMaterials() {
+        return materials_;
+    }
+
     const std::unordered_map<std::string, Material>& GetMaterials() const {
         return materials_;
     }
 
+    const std::vector<LodMesh>& GetLodMeshes() const {
+        return lod_meshes_;
+    }
+
+    const LodOptions& GetLodOptions() const {
+        return lod_options_;
+    }
+
+    SceneMemoryReport GetMemoryReport() const {
+        SceneMemoryReport report = load_memory_;
+        constexpr size_t kNormalsBytes = sizeof(std::array<std::optional<Vector>, 3>);
+        report.triangles = objects_.capacity() * (sizeof(Object) - kNormalsBytes);
+        report.normals = objects_.capacity() * kNormalsBytes;
+        report.polygons = GetVectorBytes(polygons_.objects) + GetVectorBytes(polygons_.vertices) +
+                          GetVectorBytes(polygons_.normals) + GetVectorBytes(polygons_.indices);
+        report.spheres = GetVectorBytes(sphere_objects_);
+        report.lights = GetVectorBytes(lights_);
+
+        report.materials = GetStringMapBytes(materials_);
+        for (const auto& [name, material] : materials_) {
+            report.materials += GetStringBytes(material.name);
+        }
+
+        report.acceleration = GetVectorBytes(lod_meshes_);
+        for (const auto& mesh : lod_meshes_) {
+            report.acceleration += GetVectorBytes(mesh.levels);
+            for (const auto& level : mesh.levels) {
+                report.acceleration += GetVectorBytes(level.objects);
+            }
+        }
+        return report;
+    }
+
+    // Reorders the primitives along a Morton curve of their centroids, so that primitives close
+    // in space are close in memory. Must be called before BuildLods().
+    void SortSpatially() {
+        SortObjectsSpatially(&objects_);
+        SortPolygonsSpatially(&polygons_);
+        SortSpheresSpatially(&sphere_objects_);
+    }
+
+    // Must be called before BuildLods(), whose meshes refer to runs of objects.
+    size_t RemoveDegenerateTriangles(double min_area) {
+        return ::RemoveDegenerateTriangles(&objects_, min_area);
+    }
+
+    // What the cleanup of ReadScene() removed, if it was enabled.
+    const MeshCleanupReport& GetCleanupReport() const {
+        return cleanup_report_;
+    }
+
+    void SetCleanupReport(const MeshCleanupReport& report) {
+        cleanup_report_ = report;
+    }
+
+    // Set by ReadScene(), which knows what the loader held.
+    void SetLoadMemory(size_t loader, size_t load_peak) {
+        load_memory_.loader = loader;
+        load_memory_.load_peak = load_peak;
+    }
+
+    void BuildLods(const LodOptions& options) {
+        TraceScope trace("BuildLods");
+        lod_options_ = options;
+        lod_meshes_ = BuildLodMeshes(objects_, options);
+    }
+
     void ReadMaterials(const std::filesystem::path& path) {
         materials_ = ::ReadMaterials(path);
     }
 
-    void Create(std::vector<Vector>& vertices, std::vector<Vector>& normals,
-                std::vector<ObjectMeta>& objs, std::vector<SphereObjectMeta>& sphere_objects,
-                std::vector<LightObjectMeta>& lights) {
-
-        objects_ = CreateObjects(vertices, normals, materials_, objs);
-        sphere_objects_ = CreateSphereObjects(sphere_objects, materials_);
+    void Create(const std::vector<Vector>& vertices, const std::vector<Vector>& normals,
+                const std::vector<ObjPoint>& points, const std::vector<ObjectMeta>& objs,
+                const std::vector<SphereObjectMeta>& sphere_objects,
+                const std::vector<LightObjectMeta>& lights,
+                const std::vector<std::string>& material_names, bool native_polygons = false) {
+
+        TraceScope trace("Scene::Create");
+        MaterialResolver resolver(material_names, materials_);
+        objects_ = CreateObjects(vertices, normals, points, resolver, objs,
+                                 native_polygons ? &polygons_ : nullptr);
+        sphere_objects_ = CreateSphereObjects(sphere_objects, resolver);
         lights_ = CreateLights(lights);
     }
 
 private:
     std::vector<Object> objects_;
+    PolygonPool polygons_;
     std::vector<SphereObject> sphere_objects_;
     std::vector<Light> lights_;
     std::unordered_map<std::string, Material> materials_;
+    std::vector<LodMesh> lod_meshes_;
+    LodOptions lod_options_;
+    SceneMemoryReport load_memory_;
+    MeshCleanupReport cleanup_report_;
 };
 
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path& path) {
+    TraceScope trace("ReadMaterials");
     std::unordered_map<std::string, Material> materials;
 
     Material material;
@@ -192,79 +395,326 @@ std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::p
     return materials;
 }
 
-auto ReadObjFile(const std::filesystem::path& path) {
-    std::string curr_material_name;
-    std::string material_file_name;
+class MaterialNameTable {
+public:
+    int Intern(const std::string& name) {
+        auto [it, inserted] = ids_.try_emplace(name, static_cast<int>(names_.size()));
+        if (inserted) {
+            names_.push_back(name);
+        }
+        return it->second;
+    }
+
+    std::vector<std::string>& GetNames() {
+        return names_;
+    }
+
+    size_t GetBytes() const {
+        return GetStringVectorBytes(names_) + GetStringMapBytes(ids_);
+    }
+
+private:
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, int> ids_;
+};
+
+// Loader output for one run of whole lines. Negative (relative) indices are resolved against
+// the chunk's own vertex counts and remembered, so they can be shifted once the number of
+// vertices in preceding chunks is known. Faces and spheres before the chunk's first usemtl get
+// kInheritedMaterial and take the material that is current at the end of the previous chunk.
+struct ObjChunk {
+    static constexpr int kInheritedMaterial = -1;
 
     std::vector<Vector> vertices;
     std::vector<Vector> normals;
 
+    std::vector<ObjPoint> points;
+    std::vector<size_t> relative_vertex_points;
+    std::vector<size_t> relative_normal_points;
+
     std::vector<ObjectMeta> objs;
     std::vector<SphereObjectMeta> sphere_objects;
     std::vector<LightObjectMeta> lights;
 
-    std::ifstream is{path};
-    while (!is.eof()) {
+    MaterialNameTable material_names;
+    int last_material_id = kInheritedMaterial;
+    std::optional<std::string> material_file_name;
+};
 
-        std::string line;
-        std::getline(is, line);
+size_t GetObjChunkBytes(const ObjChunk& chunk) {
+    size_t bytes = GetVectorBytes(chunk.vertices) + GetVectorBytes(chunk.normals) +
+                   GetVectorBytes(chunk.points) + GetVectorBytes(chunk.relative_vertex_points) +
+                   GetVectorBytes(chunk.relative_normal_points) + GetVectorBytes(chunk.objs) +
+                   GetVectorBytes(chunk.sphere_objects) + GetVectorBytes(chunk.lights) +
+                   chunk.material_names.GetBytes();
+    if (chunk.material_file_name) {
+        bytes += GetStringBytes(chunk.material_file_name.value());
+    }
+    return bytes;
+}
+
+ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    int curr_material_id = ObjChunk::kInheritedMaterial;
+
+    std::vector<FaceIndices> face;
+
+    while (!text.empty()) {
+        auto line_end = text.find('\n');
+        std::istringstream iss{std::string(text.substr(0, line_end))};
+        text.remove_prefix(line_end == std::string_view::npos ? text.size() : line_end + 1);
 
-        std::istringstream iss{line};
         std::string type;
 
         iss >> type;
         if (type == "mtllib") {
-            material_file_name = ReadString(iss);
+            chunk.material_file_name = ReadString(iss);
 
         } else if (type == "v") {
-            vertices.push_back(ReadVector(iss));
+            chunk.vertices.push_back(ReadVector(iss));
 
         } else if (type == "vn") {
-            normals.push_back(ReadVector(iss));
+            chunk.normals.push_back(ReadVector(iss));
 
         } else if (type == "f") {
-            auto tuples = ReadF(iss);
+            ReadF(iss, &face);
 
-            ObjectMeta om;
-            om.material_name = curr_material_name;
-            for (auto& [v_idx, _, vn_idx] : tuples) {
+            chunk.objs.push_back({curr_material_id, chunk.points.size(), face.size()});
+            for (auto& [v_idx, _, vn_idx] : face) {
+                if (v_idx.value() < 0) {
+                    chunk.relative_vertex_points.push_back(chunk.points.size());
+                }
+                if (vn_idx && vn_idx.value() < 0) {
+                    chunk.relative_normal_points.push_back(chunk.points.size());
+                }
 
                 if (vn_idx) {
-                    om.points.emplace_back(GetIndex(v_idx.value(), vertices.size()),
-                                           GetIndex(vn_idx.value(), normals.size()));
+                    chunk.points.emplace_back(GetIndex(v_idx.value(), chunk.vertices.size()),
+                                              GetIndex(vn_idx.value(), chunk.normals.size()));
                 } else {
-                    om.points.emplace_back(GetIndex(v_idx.value(), vertices.size()), std::nullopt);
+                    chunk.points.emplace_back(GetIndex(v_idx.value(), chunk.vertices.size()),
+                                              std::nullopt);
                 }
             }
-            objs.push_back(om);
 
         } else if (type == "usemtl") {
-            curr_material_name = ReadString(iss);
+            curr_material_id = chunk.material_names.Intern(ReadString(iss));
+            chunk.last_material_id = curr_material_id;
 
         } else if (type == "S") {
             auto sphere = ReadSphere(iss);
-            sphere_objects.push_back({curr_material_name, sphere});
+            chunk.sphere_objects.push_back({curr_material_id, sphere});
 
         } else if (type == "P") {
             auto light = ReadLight(iss);
-            lights.push_back({light});
+            chunk.lights.push_back({light});
 
         } else {
             continue;
         }
     }
 
-    is.close();
-    return std::make_tuple(vertices, normals, objs, sphere_objects, lights, material_file_name);
+    return chunk;
+}
+
+// Splits text into at most num_chunks pieces of similar size, cutting only after a newline.
+std::vector<std::string_view> SplitLines(std::string_view text, size_t num_chunks) {
+    std::vector<std::string_view> chunks;
+    auto chunk_size = text.size() / std::max<size_t>(num_chunks, 1) + 1;
+
+    while (!text.empty()) {
+        auto end = text.find('\n', std::min(chunk_size, text.size()) - 1);
+        end = end == std::string_view::npos ? text.size() : end + 1;
+        chunks.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    return chunks;
+}
+
+std::vector<ObjChunk> ParseObjChunks(std::string_view text, size_t num_threads) {
+    auto pieces = SplitLines(text, num_threads);
+    std::vector<ObjChunk> chunks(pieces.size());
+
+    if (pieces.size() <= 1) {
+        for (size_t i = 0; i < pieces.size(); ++i) {
+            chunks[i] = ParseObjChunk(pieces[i]);
+        }
+        return chunks;
+    }
+
+    std::vector<std::exception_ptr> errors(pieces.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        workers.emplace_back([&, i] {
+            try {
+                TraceScope trace("ParseObjChunk", static_cast<int64_t>(i));
+                chunks[i] = ParseObjChunk(pieces[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return chunks;
 }
 
-Scene ReadScene(const std::filesystem::path& path) {
+// Reads the .obj file, parsing up to num_threads chunks of it concurrently. The result doesn't
+// depend on num_threads. If memory is given, its loader field gets the size of the result and
+// load_peak the bytes held at the end of the merge, when the text, the chunks and the result
+// are all alive.
+auto ReadObjFile(const std::filesystem::path& path, size_t num_threads = 1,
+                 SceneMemoryReport* memory = nullptr) {
+    TraceScope trace("ReadObjFile");
+    std::string text;
+    {
+        std::ifstream is{path, std::ios::binary};
+        text.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    }
 
-    auto [vertices, normals, objs, sphere_objects, lights, material_file_name] = ReadObjFile(path);
+    auto chunks = ParseObjChunks(text, num_threads);
+
+    MaterialNameTable material_names;
+    int curr_material_id = material_names.Intern("");
+    std::string material_file_name;
+
+    std::vector<Vector> vertices;
+    std::vector<Vector> normals;
+
+    std::vector<ObjPoint> points;
+    std::vector<ObjectMeta> objs;
+    std::vector<SphereObjectMeta> sphere_objects;
+    std::vector<LightObjectMeta> lights;
+
+    size_t num_vertices = 0, num_normals = 0, num_points = 0, num_objs = 0;
+    for (const auto& chunk : chunks) {
+        num_vertices += chunk.vertices.size();
+        num_normals += chunk.normals.size();
+        num_points += chunk.points.size();
+        num_objs += chunk.objs.size();
+    }
+    vertices.reserve(num_vertices);
+    normals.reserve(num_normals);
+    points.reserve(num_points);
+    objs.reserve(num_objs);
+
+    for (auto& chunk : chunks) {
+        std::vector<int> global_ids;
+        for (const auto& name : chunk.material_names.GetNames()) {
+            global_ids.push_back(material_names.Intern(name));
+        }
+        auto to_global = [&](int material_id) {
+            if (material_id == ObjChunk::kInheritedMaterial) {
+                return curr_material_id;
+            }
+            return global_ids[material_id];
+        };
+
+        for (auto point_idx : chunk.relative_vertex_points) {
+            chunk.points[point_idx].v_idx += vertices.size();
+        }
+        for (auto point_idx : chunk.relative_normal_points) {
+            chunk.points[point_idx].vn_idx.value() += normals.size();
+        }
+
+        for (auto obj_meta : chunk.objs) {
+            obj_meta.material_id = to_global(obj_meta.material_id);
+            obj_meta.first_point += points.size();
+            objs.push_back(obj_meta);
+        }
+        for (auto obj_meta : chunk.sphere_objects) {
+            obj_meta.material_id = to_global(obj_meta.material_id);
+            sphere_objects.push_back(obj_meta);
+        }
+        curr_material_id = to_global(chunk.last_material_id);
+
+        if (chunk.material_file_name) {
+            material_file_name = chunk.material_file_name.value();
+        }
+
+        vertices.insert(vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        normals.insert(normals.end(), chunk.normals.begin(), chunk.normals.end());
+        points.insert(points.end(), chunk.points.begin(), chunk.points.end());
+        lights.insert(lights.end(), chunk.lights.begin(), chunk.lights.end());
+    }
+
+    if (memory) {
+        // The name table's vector is returned, its index map is not.
+        auto names_bytes = GetStringVectorBytes(material_names.GetNames());
+        memory->loader = GetVectorBytes(vertices) + GetVectorBytes(normals) +
+                         GetVectorBytes(points) + GetVectorBytes(objs) +
+                         GetVectorBytes(sphere_objects) + GetVectorBytes(lights) + names_bytes +
+                         GetStringBytes(material_file_name);
+        memory->load_peak =
+            memory->loader - names_bytes + material_names.GetBytes() + text.capacity();
+        for (const auto& chunk : chunks) {
+            memory->load_peak += GetObjChunkBytes(chunk);
+        }
+        memory->load_peak += GetVectorBytes(chunks);
+    }
+
+    return std::make_tuple(std::move(vertices), std::move(normals), std::move(points),
+                           std::move(objs), std::move(sphere_objects), std::move(lights),
+                           std::move(material_names.GetNames()), material_file_name);
+}
+
+struct SceneLoadOptions {
+    size_t num_threads = 1;
+    // Simplified levels of detail for large meshes, used by renders of distant geometry.
+    std::optional<LodOptions> lods = std::nullopt;
+    // Welding of duplicate vertices and removal of degenerate triangles, for fewer primitives.
+    std::optional<MeshCleanupOptions> cleanup = std::nullopt;
+    // Planar convex faces with more than three vertices become single PolygonObjects instead of
+    // fans of triangles, which halves the primitive tests of quad-heavy scenes.
+    bool native_polygons = false;
+    // Primitives in Morton order of their centroids instead of file order, for memory locality.
+    bool spatial_sort = false;
+};
+
+Scene ReadScene(const std::filesystem::path& path, const SceneLoadOptions& options = {}) {
+    TraceScope trace("ReadScene");
+
+    SceneMemoryReport loader_memory;
+    auto [vertices, normals, points, objs, sphere_objects, lights, material_names,
+          material_file_name] = ReadObjFile(path, options.num_threads, &loader_memory);
+
+    MeshCleanupReport cleanup_report;
+    if (options.cleanup) {
+        auto welded = WeldVertices(vertices, options.cleanup->weld_tolerance);
+        for (size_t i = 0; i < welded.size(); ++i) {
+            cleanup_report.welded_vertices += welded[i] != static_cast<int>(i);
+        }
+        for (auto& point : points) {
+            point.v_idx = welded[point.v_idx];
+        }
+    }
 
     Scene scene;
     scene.ReadMaterials(path.parent_path() / material_file_name);
-    scene.Create(vertices, normals, objs, sphere_objects, lights);
+    scene.Create(vertices, normals, points, objs, sphere_objects, lights, material_names,
+                 options.native_polygons);
+    if (options.cleanup) {
+        cleanup_report.removed_triangles =
+            scene.RemoveDegenerateTriangles(options.cleanup->min_area);
+        scene.SetCleanupReport(cleanup_report);
+    }
+    if (options.spatial_sort) {
+        scene.SortSpatially();
+    }
+    if (options.lods) {
+        scene.BuildLods(options.lods.value());
+    }
+
+    // The loader's tables stay alive until the scene is complete.
+    auto resident = scene.GetMemoryReport().GetResidentBytes();
+    scene.SetLoadMemory(loader_memory.loader,
+                        std::max(loader_memory.load_peak, loader_memory.loader + resident));
 
     return scene;
-}
\ No newline at end of file
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <numbers>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Where the centers of generated triangles and spheres lie inside the scene cube.
+enum class SceneDistribution {
+    kUniform,
+    // Gaussian blobs around randomly placed cluster centers, which stresses uneven acceleration
+    // structures and row load balancing.
+    kClustered
+};
+
+struct SceneGeneratorOptions {
+    size_t triangles = 10000;
+    size_t spheres = 100;
+    size_t lights = 4;
+    // Fractions of primitives that get the mirror and the refractive material; the rest get one
+    // of num_diffuse diffuse materials.
+    double mirror_fraction = 0.1;
+    double refractive_fraction = 0.05;
+    size_t num_diffuse = 8;
+    SceneDistribution distribution = SceneDistribution::kUniform;
+    size_t clusters = 16;
+    // Primitives are centered inside [-extent, extent]^3 (clusters may spill over slightly).
+    double extent = 10;
+    double triangle_size = 0.1;
+    double sphere_radius = 0.2;
+    uint64_t seed = 1;
+};
+
+// SplitMix64 with its own conversions to doubles, so that a seed produces the same scene with
+// every standard library.
+class SceneRandom {
+public:
+    explicit SceneRandom(uint64_t seed) : state_(seed) {
+    }
+
+    uint64_t Next() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, 1).
+    double Uniform() {
+        return static_cast<double>(Next() >> 11) * 0x1p-53;
+    }
+
+    double Uniform(double min, double max) {
+        return min + (max - min) * Uniform();
+    }
+
+    // Standard normal, by the Box-Muller transform.
+    double Normal() {
+        double u = 1 - Uniform();
+        return std::sqrt(-2 * std::log(u)) * std::cos(2 * std::numbers::pi * Uniform());
+    }
+
+private:
+    uint64_t state_;
+};
+
+// Writes a .obj file in the dialect of ReadScene() and the .mtl file it refers to, which is put
+// next to it. The .obj is streamed with runs of primitives grouped by material, so memory use
+// doesn't grow with the primitive count. Faces use relative vertex indices.
+class SceneGenerator {
+public:
+    explicit SceneGenerator(const SceneGeneratorOptions& options)
+        : options_(options), random_(options.seed) {
+        if (options_.mirror_fraction < 0 || options_.refractive_fraction < 0 ||
+            options_.mirror_fraction + options_.refractive_fraction > 1) {
+            throw std::runtime_error("Material fractions must lie in [0, 1] and sum to at most 1");
+        }
+        if (options_.num_diffuse == 0 || options_.clusters == 0) {
+            throw std::runtime_error("At least one diffuse material and cluster are needed");
+        }
+        for (size_t i = 0; i < options_.clusters; ++i) {
+            cluster_centers_.push_back(RandomPoint(0.8 * options_.extent));
+        }
+    }
+
+    void Write(const std::filesystem::path& obj_path) {
+        auto mtl_path = obj_path;
+        mtl_path.replace_extension(".mtl");
+        std::ofstream obj(obj_path, std::ios::binary);
+        std::ofstream mtl(mtl_path, std::ios::binary);
+        if (!obj || !mtl) {
+            throw std::runtime_error("Can't write " + obj_path.string());
+        }
+        WriteMaterials(mtl);
+        WriteObj(obj, mtl_path.filename().string());
+        if (!obj || !mtl) {
+            throw std::runtime_error("Failed writing " + obj_path.string());
+        }
+    }
+
+    void WriteMaterials(std::ostream& os) {
+        for (size_t i = 0; i < options_.num_diffuse; ++i) {
+            os << "newmtl diffuse" << i << "\nKd";
+            for (size_t k = 0; k < 3; ++k) {
+                os << " " << FormatNumber(random_.Uniform(0.2, 0.9));
+            }
+            os << "\nKs 0.1 0.1 0.1\nNs 16\n\n";
+        }
+        os << "newmtl mirror\nKd 0.05 0.05 0.05\nKs 0.9 0.9 0.9\nNs 1024\nal 0.2 0.8 0\n\n";
+        os << "newmtl glass\nKs 0.5 0.5 0.5\nNs 256\nNi 1.5\nal 0 0.3 0.7\n";
+    }
+
+    void WriteObj(std::ostream& os, const std::string& mtl_name) {
+        os << "mtllib " << mtl_name << "\n";
+
+        auto materials = GetMaterialNames();
+        for (size_t light = 0; light < options_.lights; ++light) {
+            auto position = RandomPoint(1.2 * options_.extent);
+            double intensity = 1. / std::max<size_t>(options_.lights, 1);
+            os << "P";
+            WriteNumbers(os, position);
+            WriteNumbers(os, {intensity, intensity, intensity});
+            os << "\n";
+        }
+
+        auto sphere_counts = GetMaterialCounts(options_.spheres);
+        for (size_t m = 0; m < materials.size(); ++m) {
+            if (sphere_counts[m] > 0) {
+                os << "usemtl " << materials[m] << "\n";
+            }
+            for (size_t i = 0; i < sphere_counts[m]; ++i) {
+                os << "S";
+                WriteNumbers(os, DistributedPoint());
+                WriteNumbers(os, {options_.sphere_radius * random_.Uniform(0.5, 1.5)});
+                os << "\n";
+            }
+        }
+
+        auto triangle_counts = GetMaterialCounts(options_.triangles);
+        for (size_t m = 0; m < materials.size(); ++m) {
+            if (triangle_counts[m] > 0) {
+                os << "usemtl " << materials[m] << "\n";
+            }
+            for (size_t i = 0; i < triangle_counts[m]; ++i) {
+                auto center = DistributedPoint();
+                for (size_t k = 0; k < 3; ++k) {
+                    os << "v";
+                    for (size_t axis = 0; axis < 3; ++axis) {
+                        double offset = options_.triangle_size * random_.Uniform(-1, 1);
+                        WriteNumbers(os, {center[axis] + offset});
+                    }
+                    os << "\n";
+                }
+                os << "f -3 -2 -1\n";
+            }
+        }
+    }
+
+    // Diffuse materials first, then "mirror" and "glass".
+    std::vector<std::string> GetMaterialNames() const {
+        std::vector<std::string> names;
+        for (size_t i = 0; i < options_.num_diffuse; ++i) {
+            names.push_back("diffuse" + std::to_string(i));
+        }
+        names.push_back("mirror");
+        names.push_back("glass");
+        return names;
+    }
+
+private:
+    using Point = std::array<double, 3>;
+
+    // Draws the material of each of count primitives and returns how many got each material.
+    std::vector<size_t> GetMaterialCounts(size_t count) {
+        std::vector<size_t> counts(options_.num_diffuse + 2);
+        for (size_t i = 0; i < count; ++i) {
+            double u = random_.Uniform();
+            if (u < options_.mirror_fraction) {
+                ++counts[options_.num_diffuse];
+            } else if (u < options_.mirror_fraction + options_.refractive_fraction) {
+                ++counts[options_.num_diffuse + 1];
+            } else {
+                ++counts[random_.Next() % options_.num_diffuse];
+            }
+        }
+        return counts;
+    }
+
+    Point RandomPoint(double extent) {
+        return {random_.Uniform(-extent, extent), random_.Uniform(-extent, extent),
+                random_.Uniform(-extent, extent)};
+    }
+
+    Point DistributedPoint() {
+        if (options_.distribution == SceneDistribution::kUniform) {
+            return RandomPoint(options_.extent);
+        }
+        const auto& center = cluster_centers_[random_.Next() % cluster_centers_.size()];
+        double spread = 0.05 * options_.extent;
+        return {center[0] + spread * random_.Normal(), center[1] + spread * random_.Normal(),
+                center[2] + spread * random_.Normal()};
+    }
+
+    static std::string FormatNumber(double value) {
+        char text[32];
+        auto result = std::to_chars(text, text + sizeof(text), value, std::chars_format::fixed, 6);
+        return std::string(text, result.ptr);
+    }
+
+    static void WriteNumbers(std::ostream& os, std::initializer_list<double> values) {
+        for (double value : values) {
+            os << ' ' << FormatNumber(value);
+        }
+    }
+
+    static void WriteNumbers(std::ostream& os, const Point& point) {
+        WriteNumbers(os, {point[0], point[1], point[2]});
+    }
+
+    SceneGeneratorOptions options_;
+    SceneRandom random_;
+    std::vector<Point> cluster_centers_;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bytes used by a scene, by category. Containers are counted by capacity; hash maps also count
+// their bucket array and one node per element as laid out by libstdc++ (next pointer, value and
+// cached hash). Allocator bookkeeping is not included.
+struct SceneMemoryReport {
+    // Triangle vertices and material pointers of the objects.
+    size_t triangles = 0;
+    // The three optional per-vertex normals of every object.
+    size_t normals = 0;
+    // Native polygons with their vertex and normal arrays.
+    size_t polygons = 0;
+    size_t spheres = 0;
+    size_t lights = 0;
+    // The material map, its string keys and material names.
+    size_t materials = 0;
+    // Levels of detail and other data that only speeds up rendering.
+    size_t acceleration = 0;
+    // Vertex, point and face tables of the .obj loader, freed once ReadScene() returns.
+    size_t loader = 0;
+    // Highest number of bytes held at once during ReadScene(), including the file text and the
+    // per-chunk tables of the parser. Zero for scenes built otherwise.
+    size_t load_peak = 0;
+
+    // What the scene keeps after loading.
+    size_t GetResidentBytes() const {
+        return triangles + normals + polygons + spheres + lights + materials + acceleration;
+    }
+};
+
+template <class T>
+size_t GetVectorBytes(const std::vector<T>& vector) {
+    return vector.capacity() * sizeof(T);
+}
+
+// Heap bytes of the string; short strings live inside the object.
+size_t GetStringBytes(const std::string& string) {
+    static const size_t kInlineCapacity = std::string().capacity();
+    return string.capacity() > kInlineCapacity ? string.capacity() + 1 : 0;
+}
+
+size_t GetStringVectorBytes(const std::vector<std::string>& strings) {
+    size_t bytes = GetVectorBytes(strings);
+    for (const auto& string : strings) {
+        bytes += GetStringBytes(string);
+    }
+    return bytes;
+}
+
+// Includes the heap bytes of the keys but not of the values, which callers add.
+template <class Value>
+size_t GetStringMapBytes(const std::unordered_map<std::string, Value>& map) {
+    using Node = typename std::unordered_map<std::string, Value>::value_type;
+    // A single bucket is stored inside the map.
+    size_t bytes = map.bucket_count() > 1 ? map.bucket_count() * sizeof(void*) : 0;
+    bytes += map.size() * (sizeof(void*) + sizeof(Node) + sizeof(size_t));
+    for (const auto& [key, value] : map) {
+        bytes += GetStringBytes(key);
+    }
+    return bytes;
+}
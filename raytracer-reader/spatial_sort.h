@@ -0,0 +1,106 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <morton.h>
+#include <object.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Rebuilds items in the order of increasing keys, ties kept in their old order. Objects hold
+// const geometry and can't be swapped in place.
+template <class T, class Key>
+void ReorderByKeys(std::vector<T>* items, const std::vector<Key>& keys) {
+    std::vector<size_t> order(items->size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&keys](size_t lhs, size_t rhs) { return keys[lhs] < keys[rhs]; });
+
+    std::vector<T> sorted;
+    sorted.reserve(items->size());
+    for (auto i : order) {
+        sorted.push_back(std::move((*items)[i]));
+    }
+    items->swap(sorted);
+}
+
+// Ranks materials by their first use, so that sorting by rank keeps the objects of a material
+// together in file order of the materials.
+template <class T>
+std::vector<size_t> GetMaterialRanks(const std::vector<T>& items) {
+    std::unordered_map<const Material*, size_t> ranks;
+    std::vector<size_t> result;
+    result.reserve(items.size());
+    for (const auto& item : items) {
+        result.push_back(ranks.try_emplace(item.material, ranks.size()).first->second);
+    }
+    return result;
+}
+
+// Sorts the objects along a Morton curve of their centroids within each material. Every object
+// keeps its material and normals; grouping by material also keeps whole meshes contiguous for
+// BuildLodMeshes.
+void SortObjectsSpatially(std::vector<Object>* objects) {
+    BoundingBox bounds;
+    for (const auto& object : *objects) {
+        for (size_t k = 0; k < 3; ++k) {
+            bounds.Extend(object.polygon[k]);
+        }
+    }
+
+    auto ranks = GetMaterialRanks(*objects);
+    std::vector<std::pair<size_t, uint64_t>> keys;
+    keys.reserve(objects->size());
+    for (size_t i = 0; i < objects->size(); ++i) {
+        const auto& triangle = (*objects)[i].polygon;
+        auto centroid = (triangle[0] + triangle[1] + triangle[2]) / 3;
+        keys.emplace_back(ranks[i], GetMortonCode(centroid, bounds));
+    }
+    ReorderByKeys(objects, keys);
+}
+
+// Only the objects move; the runs they index stay where they are.
+void SortPolygonsSpatially(PolygonPool* polygons) {
+    auto& objects = polygons->objects;
+    BoundingBox bounds;
+    std::vector<Vector> centroids;
+    centroids.reserve(objects.size());
+    for (const auto& object : objects) {
+        auto polygon = polygons->GetPolygon(object);
+        Vector centroid;
+        for (size_t k = 0; k < polygon.Size(); ++k) {
+            bounds.Extend(polygon[k]);
+            centroid = centroid + polygon[k];
+        }
+        centroids.push_back(centroid / static_cast<double>(polygon.Size()));
+    }
+
+    auto ranks = GetMaterialRanks(objects);
+    std::vector<std::pair<size_t, uint64_t>> keys;
+    keys.reserve(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        keys.emplace_back(ranks[i], GetMortonCode(centroids[i], bounds));
+    }
+    ReorderByKeys(&objects, keys);
+}
+
+// Spheres aren't grouped into meshes, so they are sorted along one curve regardless of material.
+void SortSpheresSpatially(std::vector<SphereObject>* spheres) {
+    BoundingBox bounds;
+    for (const auto& object : *spheres) {
+        bounds.Extend(object.sphere.GetCenter());
+    }
+
+    std::vector<uint64_t> keys;
+    keys.reserve(spheres->size());
+    for (const auto& object : *spheres) {
+        keys.push_back(GetMortonCode(object.sphere.GetCenter(), bounds));
+    }
+    ReorderByKeys(spheres, keys);
+}
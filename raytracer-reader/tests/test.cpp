@@ -1,4 +1,5 @@
 #include <scene.h>
+#include <scene_generator.h>
 #include <util.h>
 
 #include <catch2/catch_test_macros.hpp>
@@ -136,3 +137,217 @@ TEST_CASE("Scene") {
     Check(back_wall.albedo, .5, 0., 0.);
     Check(back_wall.diffuse_color, .725, .91, .88);
 }
+
+TEST_CASE("Parallel loading") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto expected = ReadScene(current_dir / "box/cube.obj");
+
+    for (size_t num_threads : {2, 3, 16, 1000}) {
+        const auto scene = ReadScene(current_dir / "box/cube.obj", {.num_threads = num_threads});
+
+        const auto& objects = scene.GetObjects();
+        REQUIRE(objects.size() == expected.GetObjects().size());
+        for (size_t i = 0; i < objects.size(); ++i) {
+            const auto& obj = objects[i];
+            const auto& expected_obj = expected.GetObjects()[i];
+            REQUIRE(obj.NormalExists() == expected_obj.NormalExists());
+            for (size_t j = 0; j < 3; ++j) {
+                CHECK(obj.polygon[j] == expected_obj.polygon[j]);
+                if (obj.NormalExists()) {
+                    CHECK(*obj.GetNormal(j) == *expected_obj.GetNormal(j));
+                }
+            }
+            CHECK(obj.material->name == expected_obj.material->name);
+        }
+
+        const auto& spheres = scene.GetSphereObjects();
+        REQUIRE(spheres.size() == expected.GetSphereObjects().size());
+        for (size_t i = 0; i < spheres.size(); ++i) {
+            const auto& expected_sphere = expected.GetSphereObjects()[i];
+            CHECK(spheres[i].sphere.GetCenter() == expected_sphere.sphere.GetCenter());
+            CHECK(spheres[i].material->name == expected_sphere.material->name);
+        }
+
+        REQUIRE(scene.GetLights().size() == expected.GetLights().size());
+        CHECK(scene.GetMaterials().size() == expected.GetMaterials().size());
+    }
+}
+
+TEST_CASE("Memory report") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(current_dir / "box/cube.obj");
+    const auto report = scene.GetMemoryReport();
+
+    const auto& objects = scene.GetObjects();
+    CHECK(report.triangles + report.normals == objects.capacity() * sizeof(Object));
+    CHECK(report.normals == objects.capacity() * 3 * sizeof(std::optional<Vector>));
+    CHECK(report.spheres == scene.GetSphereObjects().capacity() * sizeof(SphereObject));
+    CHECK(report.lights == scene.GetLights().capacity() * sizeof(Light));
+    CHECK(report.materials > scene.GetMaterials().size() * sizeof(Material));
+    CHECK(report.acceleration == 0);
+    CHECK(report.GetResidentBytes() == report.triangles + report.normals + report.spheres +
+                                           report.lights + report.materials);
+
+    CHECK(report.loader >= 10 * sizeof(ObjectMeta));
+    CHECK(report.load_peak >= report.GetResidentBytes() + report.loader);
+    CHECK(report.load_peak > std::filesystem::file_size(current_dir / "box/cube.obj"));
+
+    const auto lod_scene =
+        ReadScene(current_dir / "box/cube.obj", {.lods = LodOptions{.min_triangles = 1}});
+    const auto lod_report = lod_scene.GetMemoryReport();
+    CHECK(lod_report.acceleration >= lod_scene.GetLodMeshes().size() * sizeof(LodMesh));
+    CHECK(lod_report.acceleration > 0);
+    CHECK(lod_report.load_peak >= lod_report.GetResidentBytes() + lod_report.loader);
+
+    CHECK(Scene().GetMemoryReport().GetResidentBytes() == 0);
+}
+
+TEST_CASE("Mesh cleanup") {
+    const auto dir = std::filesystem::temp_directory_path();
+    {
+        std::ofstream mtl(dir / "raytracer_cleanup.mtl");
+        mtl << "newmtl white\nKd 1 1 1\n";
+        std::ofstream obj(dir / "raytracer_cleanup.obj");
+        obj << "mtllib raytracer_cleanup.mtl\n"
+            << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+            << "v 1 0 0\nv 0.5 0 0\nv 1 1 1e-9\n"
+            << "usemtl white\n"
+            << "f 1 5 3\nf 1 6 2 3\nf 1 2 5\nf 1 3 4\nf 3 7 4\n";
+    }
+    const auto path = dir / "raytracer_cleanup.obj";
+
+    const auto raw = ReadScene(path);
+    CHECK(raw.GetObjects().size() == 6);
+    CHECK(raw.GetCleanupReport().removed_triangles == 0);
+
+    const auto exact = ReadScene(path, {.cleanup = MeshCleanupOptions{.min_area = 0}});
+    CHECK(exact.GetObjects().size() == 4);
+    CHECK(exact.GetCleanupReport().welded_vertices == 1);
+    CHECK(exact.GetCleanupReport().removed_triangles == 2);
+
+    const auto scene = ReadScene(path, {.cleanup = MeshCleanupOptions{}});
+    CHECK(scene.GetObjects().size() == 3);
+    CHECK(scene.GetCleanupReport().welded_vertices == 1);
+    CHECK(scene.GetCleanupReport().removed_triangles == 3);
+    Check(scene.GetObjects()[1].polygon[2], 1, 1, 0);
+    for (const auto& object : scene.GetObjects()) {
+        CHECK(object.polygon.Area() == 0.5);
+    }
+
+    const auto welded = ReadScene(
+        path, {.cleanup = MeshCleanupOptions{.weld_tolerance = 1e-3, .min_area = 0}});
+    CHECK(welded.GetObjects().size() == 3);
+    CHECK(welded.GetCleanupReport().welded_vertices == 2);
+    CHECK(welded.GetCleanupReport().removed_triangles == 3);
+
+    std::filesystem::remove(dir / "raytracer_cleanup.mtl");
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Scene generator") {
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto path = dir / "raytracer_generated.obj";
+
+    SceneGeneratorOptions options{.triangles = 2000,
+                                  .spheres = 50,
+                                  .lights = 3,
+                                  .mirror_fraction = 0.2,
+                                  .refractive_fraction = 0.1,
+                                  .num_diffuse = 4,
+                                  .distribution = SceneDistribution::kClustered};
+    SceneGenerator(options).Write(path);
+    auto read_file = [](const std::filesystem::path& file) {
+        std::ifstream is(file, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    };
+    const auto text = read_file(path);
+
+    const auto scene = ReadScene(path, {.num_threads = 4});
+    REQUIRE(scene.GetObjects().size() == 2000);
+    REQUIRE(scene.GetSphereObjects().size() == 50);
+    REQUIRE(scene.GetLights().size() == 3);
+    REQUIRE(scene.GetMaterials().size() == 6);
+
+    size_t mirrors = 0, refractive = 0;
+    for (const auto& object : scene.GetObjects()) {
+        mirrors += object.material->name == "mirror";
+        refractive += object.material->name == "glass";
+        CHECK(object.polygon.Area() > 0);
+    }
+    CHECK(mirrors > 300);
+    CHECK(mirrors < 500);
+    CHECK(refractive > 120);
+    CHECK(refractive < 280);
+    CHECK(scene.GetMaterials().at("glass").refraction_index == 1.5);
+
+    SceneGenerator(options).Write(path);
+    CHECK(read_file(path) == text);
+    options.seed = 2;
+    SceneGenerator(options).Write(path);
+    CHECK(read_file(path) != text);
+
+    options.mirror_fraction = 0.95;
+    CHECK_THROWS(SceneGenerator(options));
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(dir / "raytracer_generated.mtl");
+}
+
+TEST_CASE("Spatial sort") {
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto path = dir / "raytracer_spatial_sort.obj";
+    SceneGenerator({.triangles = 3000, .spheres = 200, .num_diffuse = 3}).Write(path);
+
+    const auto file_order = ReadScene(path);
+    const auto scene = ReadScene(path, {.spatial_sort = true});
+    const auto& objects = scene.GetObjects();
+    REQUIRE(objects.size() == file_order.GetObjects().size());
+    REQUIRE(scene.GetSphereObjects().size() == file_order.GetSphereObjects().size());
+
+    auto get_key = [](const Object& object) {
+        std::pair<std::string, std::vector<double>> key = {object.material->name, {}};
+        for (size_t k = 0; k < 3; ++k) {
+            for (size_t axis = 0; axis < 3; ++axis) {
+                key.second.push_back(object.polygon[k][axis]);
+            }
+        }
+        return key;
+    };
+    std::vector<std::pair<std::string, std::vector<double>>> expected, actual;
+    for (const auto& object : file_order.GetObjects()) {
+        expected.push_back(get_key(object));
+    }
+    for (const auto& object : objects) {
+        actual.push_back(get_key(object));
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    CHECK(actual == expected);
+
+    auto get_path_length = [](const std::vector<Object>& objects) {
+        double length = 0;
+        for (size_t i = 1; i < objects.size(); ++i) {
+            length += Length(objects[i].polygon[0] - objects[i - 1].polygon[0]);
+        }
+        return length;
+    };
+    CHECK(get_path_length(objects) < get_path_length(file_order.GetObjects()) / 4);
+
+    size_t material_runs = 1;
+    for (size_t i = 1; i < objects.size(); ++i) {
+        material_runs += objects[i].material != objects[i - 1].material;
+    }
+    CHECK(material_runs == scene.GetMaterials().size());
+
+    double sphere_path = 0, file_sphere_path = 0;
+    for (size_t i = 1; i < scene.GetSphereObjects().size(); ++i) {
+        sphere_path += Length(scene.GetSphereObjects()[i].sphere.GetCenter() -
+                              scene.GetSphereObjects()[i - 1].sphere.GetCenter());
+        file_sphere_path += Length(file_order.GetSphereObjects()[i].sphere.GetCenter() -
+                                   file_order.GetSphereObjects()[i - 1].sphere.GetCenter());
+    }
+    CHECK(sphere_path < file_sphere_path / 2);
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(dir / "raytracer_spatial_sort.mtl");
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Timeline of scene loading and rendering in the Chrome trace event format, which
+// chrome://tracing and Perfetto display with a track per thread.
+//
+// Events are recorded by TraceScope objects while a recorder is started. Each thread appends to
+// its own buffer without locking, and the buffers are only merged by WriteJson, so recording
+// costs a clock read and a vector append per scope. Without a started recorder a TraceScope is a
+// single atomic load.
+class TraceRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr int64_t kNoArg = -1;
+
+    struct Event {
+        const char* name;
+        Clock::time_point begin;
+        Clock::time_point end;
+        int64_t arg;
+    };
+
+    TraceRecorder() : origin_(Clock::now()), session_(next_session_.fetch_add(1)) {
+    }
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    ~TraceRecorder() {
+        Stop();
+    }
+
+    // Makes this the recorder of all threads. Only one recorder can be started at a time.
+    void Start() {
+        TraceRecorder* expected = nullptr;
+        if (!active_.compare_exchange_strong(expected, this) && expected != this) {
+            throw std::runtime_error("Another trace recorder is already started");
+        }
+    }
+
+    // Scopes that are still open when the recorder stops are dropped.
+    void Stop() {
+        TraceRecorder* expected = this;
+        active_.compare_exchange_strong(expected, nullptr);
+    }
+
+    static TraceRecorder* GetActive() {
+        return active_.load(std::memory_order_acquire);
+    }
+
+    void Record(const Event& event) {
+        GetThreadBuffer().events.push_back(event);
+    }
+
+    size_t GetNumEvents() const {
+        std::lock_guard lock(mutex_);
+        size_t count = 0;
+        for (const auto& buffer : buffers_) {
+            count += buffer->events.size();
+        }
+        return count;
+    }
+
+    size_t GetNumThreads() const {
+        std::lock_guard lock(mutex_);
+        return buffers_.size();
+    }
+
+    // Must be called once the traced work has finished, as threads append without locking.
+    void WriteJson(std::ostream& os) const {
+        std::lock_guard lock(mutex_);
+        os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        for (const auto& buffer : buffers_) {
+            os << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+               << "\"tid\":" << buffer->tid << ",\"args\":{\"name\":\"thread " << buffer->tid
+               << "\"}}";
+            first = false;
+            for (const auto& event : buffer->events) {
+                os << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                   << buffer->tid << ",\"ts\":" << FormatMicroseconds(event.begin - origin_)
+                   << ",\"dur\":" << FormatMicroseconds(event.end - event.begin);
+                if (event.arg != kNoArg) {
+                    os << ",\"args\":{\"value\":" << event.arg << "}";
+                }
+                os << "}";
+            }
+        }
+        os << "\n]}\n";
+    }
+
+    void WriteJson(const std::filesystem::path& path) const {
+        std::ofstream os(path);
+        if (!os) {
+            throw std::runtime_error("Can't write trace " + path.string());
+        }
+        WriteJson(os);
+    }
+
+private:
+    struct ThreadBuffer {
+        int tid;
+        std::vector<Event> events;
+    };
+
+    // Buffers are owned by the recorder so that events of finished threads are kept. The
+    // session number tells a new recorder at the address of a destroyed one apart from it.
+    ThreadBuffer& GetThreadBuffer() {
+        thread_local struct {
+            uint64_t session = 0;
+            ThreadBuffer* buffer = nullptr;
+        } cached;
+        if (cached.session != session_) {
+            std::lock_guard lock(mutex_);
+            buffers_.push_back(std::make_unique<ThreadBuffer>());
+            buffers_.back()->tid = static_cast<int>(buffers_.size()) - 1;
+            buffers_.back()->events.reserve(1024);
+            cached.session = session_;
+            cached.buffer = buffers_.back().get();
+        }
+        return *cached.buffer;
+    }
+
+    // Timestamps are in microseconds; rows of small renders take less than one.
+    static std::string FormatMicroseconds(Clock::duration duration) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.3f",
+                      std::chrono::duration<double, std::micro>(duration).count());
+        return text;
+    }
+
+    inline static std::atomic<TraceRecorder*> active_ = nullptr;
+    inline static std::atomic<uint64_t> next_session_ = 1;
+
+    Clock::time_point origin_;
+    uint64_t session_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+};
+
+// Records the lifetime of the scope as an event of the started recorder, if any. The name must
+// outlive the recorder, which string literals do; arg is shown with the event, e.g. a row index.
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, int64_t arg = TraceRecorder::kNoArg)
+        : recorder_(TraceRecorder::GetActive()) {
+        if (recorder_) {
+            event_ = {name, TraceRecorder::Clock::now(), {}, arg};
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    ~TraceScope() {
+        if (recorder_ && TraceRecorder::GetActive() == recorder_) {
+            event_.end = TraceRecorder::Clock::now();
+            recorder_->Record(event_);
+        }
+    }
+
+private:
+    TraceRecorder* recorder_;
+    TraceRecorder::Event event_{};
+};
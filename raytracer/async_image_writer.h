@@ -0,0 +1,95 @@
+#pragma once
+
+#include <options/render_options.h>
+#include <framebuffer.h>
+#include <image.h>
+#include <raytracer.h>
+#include <thread_pool.h>
+
+#include <condition_variable>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Post-processes and encodes finished framebuffers to PNG files on background threads, so that
+// tracing of the next frame overlaps with compression of the previous ones. At most max_pending
+// frames are held at once; Write() blocks while the queue is full, which bounds memory use when
+// encoding falls behind.
+class AsyncImageWriter {
+public:
+    AsyncImageWriter(size_t num_threads, size_t max_pending)
+        : max_pending_(max_pending == 0 ? 1 : max_pending), pool_(num_threads) {
+    }
+
+    AsyncImageWriter(const AsyncImageWriter&) = delete;
+    AsyncImageWriter& operator=(const AsyncImageWriter&) = delete;
+
+    ~AsyncImageWriter() {
+        Wait();
+    }
+
+    // The future reports encoding or I/O errors of this frame.
+    std::future<void> Write(Framebuffer pixels, const RenderOptions& render_options,
+                            std::filesystem::path path) {
+        {
+            std::unique_lock lock(mutex_);
+            cv_.wait(lock, [this] { return pending_ < max_pending_; });
+            ++pending_;
+        }
+
+        return pool_.Submit([this, pixels = std::move(pixels), render_options,
+                             path = std::move(path)] {
+            struct Release {
+                AsyncImageWriter* writer;
+                ~Release() {
+                    {
+                        std::lock_guard lock(writer->mutex_);
+                        --writer->pending_;
+                    }
+                    writer->cv_.notify_all();
+                }
+            } release{this};
+
+            Image image(pixels.Width(), pixels.Height());
+            PostProcess(pixels, render_options, &image);
+            image.Write(path);
+        });
+    }
+
+    // Blocks until every submitted frame is written.
+    void Wait() {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    size_t GetPending() const {
+        std::lock_guard lock(mutex_);
+        return pending_;
+    }
+
+private:
+    size_t max_pending_;
+    size_t pending_ = 0;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    ThreadPool pool_;
+};
+
+// Renders the frames one after another on the calling thread and hands each framebuffer to the
+// writer, so the batch takes about as long as tracing alone once the writer keeps up.
+template <class SceneT>
+void RenderBatch(const SceneT& scene,
+                 const std::vector<std::pair<CameraOptions, std::filesystem::path>>& frames,
+                 const RenderOptions& render_options, AsyncImageWriter* writer) {
+    std::vector<std::future<void>> results;
+    results.reserve(frames.size());
+    for (const auto& [camera_options, path] : frames) {
+        results.push_back(
+            writer->Write(Raytrace(scene, camera_options, render_options), render_options, path));
+    }
+    for (auto& result : results) {
+        result.get();
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <framebuffer.h>
+#include <raytracer.h>
+#include <render_control.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <optional>
+#include <utility>
+
+// A render running in the background. Dropping the handle cancels the render and waits for its
+// threads to stop, which takes at most a few pixels per thread.
+class RenderHandle {
+public:
+    RenderHandle(std::shared_ptr<RenderControl> control, std::future<Framebuffer> result)
+        : control_(std::move(control)), result_(std::move(result)) {
+    }
+
+    RenderHandle(RenderHandle&&) = default;
+    RenderHandle& operator=(RenderHandle&&) = delete;
+
+    ~RenderHandle() {
+        if (control_) {
+            control_->Cancel();
+        }
+    }
+
+    void Cancel() {
+        control_->Cancel();
+    }
+
+    size_t GetCompletedPixels() const {
+        return control_->GetCompletedPixels();
+    }
+
+    size_t GetTotalPixels() const {
+        return control_->GetTotalPixels();
+    }
+
+    // Fraction of the pixels traced so far.
+    double GetProgress() const {
+        auto total = GetTotalPixels();
+        return total == 0 ? 1. : static_cast<double>(GetCompletedPixels()) / total;
+    }
+
+    template <class Rep, class Period>
+    bool WaitFor(std::chrono::duration<Rep, Period> timeout) const {
+        return result_.wait_for(timeout) == std::future_status::ready;
+    }
+
+    // Blocks until the render finishes. Throws RenderCancelled if it was cancelled or missed its
+    // deadline, and any error of the render itself.
+    Framebuffer Get() {
+        return result_.get();
+    }
+
+private:
+    std::shared_ptr<RenderControl> control_;
+    std::future<Framebuffer> result_;
+};
+
+// Starts Raytrace on a background thread, with render_options.num_threads threads tracing rows.
+// The scene is shared with the render so that it outlives an abandoned handle.
+template <class SceneT>
+RenderHandle RenderAsync(std::shared_ptr<const SceneT> scene, const CameraOptions& camera_options,
+                         const RenderOptions& render_options,
+                         std::optional<RenderControl::Clock::time_point> deadline = std::nullopt) {
+
+    auto window = GetRenderWindow(camera_options, render_options);
+    auto control = std::make_shared<RenderControl>();
+    control->SetTotalPixels(static_cast<size_t>(window.width) * window.height);
+    if (deadline) {
+        control->SetDeadline(deadline.value());
+    }
+
+    auto result = std::async(std::launch::async, [scene = std::move(scene), camera_options,
+                                                  render_options, control] {
+        return Raytrace(*scene, camera_options, render_options, control.get());
+    });
+    return RenderHandle(std::move(control), std::move(result));
+}
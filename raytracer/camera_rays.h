@@ -0,0 +1,145 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <ray.h>
+#include <vector.h>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Unit directions of a batch of camera rays, one array per component, with the pixel each ray
+// belongs to. All rays start at the camera position.
+struct RayPacket {
+    Vector origin;
+    std::vector<double> dx, dy, dz;
+    std::vector<int> x, y;
+
+    size_t Size() const {
+        return dx.size();
+    }
+
+    Ray GetRay(size_t i) const {
+        return Ray::FromUnitDirection(origin, {dx[i], dy[i], dz[i]});
+    }
+
+    void Clear() {
+        dx.clear();
+        dy.clear();
+        dz.clear();
+        x.clear();
+        y.clear();
+    }
+};
+
+// Maps continuous pixel coordinates to world space directions with a basis computed once per
+// camera: the direction through (px, py) is base + py * step_y + px * step_x, normalized. Pixel
+// (x, y) is sampled at (x + 0.5, y + 0.5). Each direction is evaluated from the row's start
+// rather than accumulated along it, so a pixel gets the same ray in every tile that covers it.
+class CameraRayGenerator {
+public:
+    CameraRayGenerator(const CameraOptions& camera_options, const Vector& forward,
+                       const Vector& right, const Vector& up)
+        : origin_(camera_options.look_from) {
+        double scale = std::tan(camera_options.fov / 2);
+        double aspect = 1.0 * camera_options.screen_width / camera_options.screen_height;
+        double half_width = aspect * scale;
+
+        // x = (2 * px / width - 1) * half_width and y = (2 * py / height - 1) * scale, and the
+        // direction is x * right - y * up - forward.
+        step_x_ = (2 * half_width / camera_options.screen_width) * right;
+        step_y_ = (-2 * scale / camera_options.screen_height) * up;
+        base_ = -half_width * right + scale * up - forward;
+    }
+
+    const Vector& GetOrigin() const {
+        return origin_;
+    }
+
+    Vector GetDirection(double px, double py) const {
+        double d[3];
+        for (size_t k = 0; k < 3; ++k) {
+            d[k] = base_[k] + py * step_y_[k] + px * step_x_[k];
+        }
+        double len = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        return {d[0] / len, d[1] / len, d[2] / len};
+    }
+
+    Ray GetPixelRay(int x, int y) const {
+        return Ray::FromUnitDirection(origin_, GetDirection(x + 0.5, y + 0.5));
+    }
+
+    // Appends the rays through the centers of pixels [x_begin, x_end) of row y.
+    void GenerateRow(int y, int x_begin, int x_end, RayPacket* packet) const {
+        packet->origin = origin_;
+        double py = y + 0.5;
+        double row[3];
+        for (size_t k = 0; k < 3; ++k) {
+            row[k] = base_[k] + py * step_y_[k];
+        }
+
+        auto size = packet->Size();
+        auto count = static_cast<size_t>(x_end - x_begin);
+        Resize(packet, size + count);
+        double* dx = packet->dx.data() + size;
+        double* dy = packet->dy.data() + size;
+        double* dz = packet->dz.data() + size;
+        for (size_t i = 0; i < count; ++i) {
+            double px = x_begin + static_cast<int>(i) + 0.5;
+            dx[i] = row[0] + px * step_x_[0];
+            dy[i] = row[1] + px * step_x_[1];
+            dz[i] = row[2] + px * step_x_[2];
+        }
+        for (size_t i = 0; i < count; ++i) {
+            double len = std::sqrt(dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i]);
+            dx[i] /= len;
+            dy[i] /= len;
+            dz[i] /= len;
+            packet->x[size + i] = x_begin + static_cast<int>(i);
+            packet->y[size + i] = y;
+        }
+    }
+
+    // Appends the rays through the pixel centers of the tile, row by row.
+    void GenerateTile(const CropWindow& tile, RayPacket* packet) const {
+        for (int y = tile.y; y < tile.y + tile.height; ++y) {
+            GenerateRow(y, tile.x, tile.x + tile.width, packet);
+        }
+    }
+
+    // Appends samples_per_pixel rays per pixel of the tile, each through a uniformly random
+    // point of its pixel.
+    template <class RandomGenerator>
+    void GenerateJittered(const CropWindow& tile, int samples_per_pixel, RandomGenerator* random,
+                          RayPacket* packet) const {
+        std::uniform_real_distribution<double> offset(0., 1.);
+        packet->origin = origin_;
+        for (int y = tile.y; y < tile.y + tile.height; ++y) {
+            for (int x = tile.x; x < tile.x + tile.width; ++x) {
+                for (int s = 0; s < samples_per_pixel; ++s) {
+                    auto direction = GetDirection(x + offset(*random), y + offset(*random));
+                    packet->dx.push_back(direction[0]);
+                    packet->dy.push_back(direction[1]);
+                    packet->dz.push_back(direction[2]);
+                    packet->x.push_back(x);
+                    packet->y.push_back(y);
+                }
+            }
+        }
+    }
+
+private:
+    static void Resize(RayPacket* packet, size_t size) {
+        packet->dx.resize(size);
+        packet->dy.resize(size);
+        packet->dz.resize(size);
+        packet->x.resize(size);
+        packet->y.resize(size);
+    }
+
+    Vector origin_;
+    Vector base_;
+    Vector step_x_;
+    Vector step_y_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <framebuffer.h>
+#include <mapped_file.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+// Linear framebuffers written without tone mapping, gamma or compression.
+//
+// kPfm is the Portable Float Map: a text header "PF\n<width> <height>\n-1\n" followed by
+// little-endian float RGB triples, rows from bottom to top.
+//
+// kRaw has a 16-byte header of four little-endian uint32: the magic "RTFB", width, height and
+// the number of channels (3), followed by float RGB triples, rows from top to bottom. The pixel
+// data starts 16-byte aligned, so a mapped file can be used as a float array directly.
+enum class FloatFormat { kPfm, kRaw };
+
+constexpr uint32_t kRawFloatMagic = 0x42465452;  // "RTFB"
+constexpr size_t kRawFloatHeaderSize = 16;
+
+static_assert(sizeof(float) == 4);
+static_assert(std::endian::native == std::endian::little);
+
+std::string GetPfmHeader(int width, int height) {
+    return "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1\n";
+}
+
+size_t GetFloatImageSize(int width, int height, FloatFormat format) {
+    size_t header = format == FloatFormat::kPfm ? GetPfmHeader(width, height).size()
+                                                : kRawFloatHeaderSize;
+    return header + static_cast<size_t>(width) * height * 3 * sizeof(float);
+}
+
+// Writes the file image of the framebuffer to data, which must hold
+// GetFloatImageSize(width, height, format) bytes.
+void EncodeFloatImage(const Framebuffer& pixels, FloatFormat format, char* data) {
+    const int width = pixels.Width();
+    const int height = pixels.Height();
+
+    if (format == FloatFormat::kPfm) {
+        auto header = GetPfmHeader(width, height);
+        std::memcpy(data, header.data(), header.size());
+        data += header.size();
+    } else {
+        const uint32_t header[4] = {kRawFloatMagic, static_cast<uint32_t>(width),
+                                    static_cast<uint32_t>(height), 3};
+        std::memcpy(data, header, sizeof(header));
+        data += sizeof(header);
+    }
+
+    const size_t row_size = static_cast<size_t>(width) * 3;
+    for (int y = 0; y < height; ++y) {
+        int source_row = format == FloatFormat::kPfm ? height - 1 - y : y;
+        const double* source = pixels.RowData(source_row);
+        float row[256];
+        for (size_t begin = 0; begin < row_size; begin += std::size(row)) {
+            auto count = std::min(std::size(row), row_size - begin);
+            for (size_t i = 0; i < count; ++i) {
+                row[i] = static_cast<float>(source[begin + i]);
+            }
+            std::memcpy(data, row, count * sizeof(float));
+            data += count * sizeof(float);
+        }
+    }
+}
+
+void WriteFloatImage(const Framebuffer& pixels, const std::filesystem::path& path,
+                     FloatFormat format) {
+    auto file =
+        MappedFile::Create(path, GetFloatImageSize(pixels.Width(), pixels.Height(), format));
+    EncodeFloatImage(pixels, format, file.Data());
+}
+
+// Reads a file written by WriteFloatImage back into a framebuffer.
+Framebuffer ReadFloatImage(const std::filesystem::path& path) {
+    auto file = MappedFile::Open(path);
+    const char* data = file.Data();
+    const char* end = data + file.Size();
+
+    int width, height;
+    bool flip;
+    uint32_t magic = 0;
+    if (file.Size() >= sizeof(magic)) {
+        std::memcpy(&magic, data, sizeof(magic));
+    }
+    if (magic == kRawFloatMagic) {
+        uint32_t header[4];
+        if (file.Size() < sizeof(header)) {
+            throw std::runtime_error("Truncated float image " + path.string());
+        }
+        std::memcpy(header, data, sizeof(header));
+        if (header[3] != 3) {
+            throw std::runtime_error("Unsupported channel count in " + path.string());
+        }
+        width = header[1];
+        height = header[2];
+        flip = false;
+        data += sizeof(header);
+    } else {
+        double scale;
+        int consumed = 0;
+        std::string text(data, std::min<size_t>(file.Size(), 64));
+        int fields =
+            std::sscanf(text.c_str(), "PF %d %d %lf%n", &width, &height, &scale, &consumed);
+        if (fields != 3 || scale >= 0) {
+            throw std::runtime_error("Not a little-endian RGB PFM file: " + path.string());
+        }
+        flip = true;
+        data += consumed + 1;
+    }
+
+    auto data_size = static_cast<size_t>(width) * height * 3 * sizeof(float);
+    if (width <= 0 || height <= 0 || static_cast<size_t>(end - data) < data_size) {
+        throw std::runtime_error("Truncated float image " + path.string());
+    }
+
+    Framebuffer pixels(width, height);
+    for (int y = 0; y < height; ++y) {
+        auto* row = pixels.Row(flip ? height - 1 - y : y);
+        for (int x = 0; x < width; ++x) {
+            float rgb[3];
+            std::memcpy(rgb, data, sizeof(rgb));
+            data += sizeof(rgb);
+            row[x] = {rgb[0], rgb[1], rgb[2]};
+        }
+    }
+    return pixels;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector.h>
+
+#include <cstddef>
+#include <vector>
+
+static_assert(sizeof(Vector) == 3 * sizeof(double));
+
+// Linear radiance per pixel, stored row by row.
+class Framebuffer {
+public:
+    Framebuffer(int width, int height)
+        : width_(width), height_(height), pixels_(static_cast<size_t>(width) * height) {
+    }
+
+    int Width() const {
+        return width_;
+    }
+    int Height() const {
+        return height_;
+    }
+
+    Vector& At(int x, int y) {
+        return pixels_[static_cast<size_t>(y) * width_ + x];
+    }
+    const Vector& At(int x, int y) const {
+        return pixels_[static_cast<size_t>(y) * width_ + x];
+    }
+
+    Vector* Row(int y) {
+        return &At(0, y);
+    }
+    const Vector* Row(int y) const {
+        return &At(0, y);
+    }
+
+    // Channels of the row as a flat array of 3 * Width() values.
+    const double* RowData(int y) const {
+        return reinterpret_cast<const double*>(Row(y));
+    }
+
+private:
+    int width_;
+    int height_;
+    std::vector<Vector> pixels_;
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <framebuffer.h>
+#include <pixel_calculator.h>
+#include <raytracer.h>
+#include <screen.h>
+
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Primary hits of a render, kept so that later renders with edited lights or materials can
+// skip camera ray intersection. Materials are stored by name, so the buffer stays valid for a
+// scene whose .mtl file was read again. Shadow ray results are kept per light and reused for
+// lights that didn't move.
+class GBuffer {
+public:
+    static constexpr int kNoMaterial = -1;
+
+    struct Sample {
+        Vector position;
+        Vector normal;
+        Vector view_direction;
+        double distance;
+        int material_id = kNoMaterial;
+    };
+
+    GBuffer(const CropWindow& window, const std::vector<Light>& lights)
+        : window_(window),
+          samples_(static_cast<size_t>(window.width) * window.height),
+          light_positions_(lights.size()),
+          shadowed_(samples_.size() * lights.size()) {
+        for (size_t i = 0; i < lights.size(); ++i) {
+            light_positions_[i] = lights[i].position;
+        }
+    }
+
+    const CropWindow& GetWindow() const {
+        return window_;
+    }
+
+    Sample& At(int x, int y) {
+        return samples_[Index(x, y)];
+    }
+    const Sample& At(int x, int y) const {
+        return samples_[Index(x, y)];
+    }
+
+    int GetMaterialId(const Material* material) {
+        auto [it, inserted] =
+            material_ids_.try_emplace(material, static_cast<int>(material_names_.size()));
+        if (inserted) {
+            material_names_.push_back(material->name);
+        }
+        return it->second;
+    }
+
+    const std::string& GetMaterialName(int material_id) const {
+        return material_names_[material_id];
+    }
+
+    // Whether the shadow ray of pixel (x, y) towards the light was blocked when it was last at
+    // position. Empty if the light is new or has moved since.
+    std::optional<bool> IsShadowed(int x, int y, size_t light, const Vector& position) const {
+        if (light >= light_positions_.size() || light_positions_[light] != position) {
+            return std::nullopt;
+        }
+        return shadowed_[Index(x, y) * light_positions_.size() + light] != 0;
+    }
+
+    void SetShadowed(int x, int y, size_t light, bool shadowed) {
+        shadowed_[Index(x, y) * light_positions_.size() + light] = shadowed;
+    }
+
+private:
+    size_t Index(int x, int y) const {
+        return static_cast<size_t>(y) * window_.width + x;
+    }
+
+    CropWindow window_;
+    std::vector<Sample> samples_;
+    std::vector<Vector> light_positions_;
+    std::vector<uint8_t> shadowed_;
+    std::vector<std::string> material_names_;
+    std::unordered_map<const Material*, int> material_ids_;
+};
+
+// Traces the camera rays of the render and the shadow rays of their hits.
+template <class SceneT>
+GBuffer BuildGBuffer(const SceneT& scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options) {
+
+    auto window = GetRenderWindow(camera_options, render_options);
+    const auto& lights = scene.GetLights();
+    GBuffer gbuffer(window, lights);
+
+    auto screen = Screen(camera_options);
+    for (int y = 0; y < window.height; ++y) {
+        for (int x = 0; x < window.width; ++x) {
+            auto ray = screen.GetCameraRay(window.x + x, window.y + y);
+            auto hit = Intersect(ray, scene);
+            if (!hit) {
+                continue;
+            }
+
+            const auto& [intersection, material, norm] = hit.value();
+            auto& sample = gbuffer.At(x, y);
+            sample = {intersection.GetPosition(), norm, ray.GetDirection(),
+                      intersection.GetDistance(), gbuffer.GetMaterialId(material)};
+
+            auto pos = GetShadowRayOrigin(intersection, norm);
+            for (size_t i = 0; i < lights.size(); ++i) {
+                gbuffer.SetShadowed(x, y, i, IsLightShadowed(pos, lights[i], scene));
+            }
+        }
+    }
+
+    return gbuffer;
+}
+
+// Renders the frame of the G-buffer with the current lights and materials of the scene, which
+// must have the geometry the buffer was built from. Only materials with a reflective or
+// refractive albedo and lights that moved or were added trace any rays.
+template <class SceneT>
+Framebuffer Relight(const GBuffer& gbuffer, const SceneT& scene,
+                    const RenderOptions& render_options) {
+
+    if (render_options.depth < 1) {
+        throw std::runtime_error("Relighting needs a depth of at least 1");
+    }
+
+    const auto& window = gbuffer.GetWindow();
+    Framebuffer preprocessed_pixels(window.width, window.height);
+    const auto& materials = scene.GetMaterials();
+    const auto& lights = scene.GetLights();
+    std::vector<const Material*> resolved;
+
+    for (int y = 0; y < window.height; ++y) {
+        for (int x = 0; x < window.width; ++x) {
+            const auto& sample = gbuffer.At(x, y);
+            if (sample.material_id == GBuffer::kNoMaterial) {
+                preprocessed_pixels.At(x, y) = CalculateMiss(render_options);
+                continue;
+            }
+
+            if (resolved.size() <= static_cast<size_t>(sample.material_id)) {
+                resolved.resize(sample.material_id + 1, nullptr);
+            }
+            auto& material = resolved[sample.material_id];
+            if (!material) {
+                material = &materials.at(gbuffer.GetMaterialName(sample.material_id));
+            }
+
+            auto ray = Ray::FromUnitDirection(
+                sample.position - sample.distance * sample.view_direction, sample.view_direction);
+            auto intersection = Intersection{sample.position, sample.normal, sample.distance};
+            auto hit = std::make_tuple(intersection, material, sample.normal);
+            if (render_options.mode != RenderMode::kFull) {
+                preprocessed_pixels.At(x, y) = CalculateHit(ray, hit, scene, render_options);
+                continue;
+            }
+
+            auto pos = GetShadowRayOrigin(intersection, sample.normal);
+            Vector light;
+            for (size_t i = 0; i < lights.size(); ++i) {
+                auto shadowed = gbuffer.IsShadowed(x, y, i, lights[i].position);
+                if (shadowed ? shadowed.value() : IsLightShadowed(pos, lights[i], scene)) {
+                    continue;
+                }
+                light += CalculateLightContribution(pos, lights[i], material, sample.normal, ray,
+                                                    render_options.fast_math);
+            }
+
+            auto [reflection, refraction] =
+                CalculateSecondary(ray, hit, scene, render_options, 0, false);
+            preprocessed_pixels.At(x, y) = ShadeHit(*material, light, reflection, refraction);
+        }
+    }
+
+    return preprocessed_pixels;
+}
@@ -1,8 +1,48 @@
 #pragma once
 
-enum class RenderMode { kDepth, kNormal, kFull };
+#include <cstddef>
+#include <optional>
+
+enum class RenderMode { kDepth, kNormal, kFull, kCost };
+
+// What kCost shows per pixel: rays traced (including shadow rays), ray-primitive intersection
+// tests, or nanoseconds spent shading the pixel.
+enum class CostMetric { kRays, kPrimitiveTests, kTime };
+
+// Sub-rectangle of the screen in pixels, with x and y of its top left corner.
+struct CropWindow {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Shadows looked up in a cube map around each light, with resolution x resolution texels per
+// face, instead of traced. Without a resolution it follows the screen, see
+// GetShadowMapResolution(). A point counts as lit unless the stored occluder is closer to the
+// light than (1 - bias) times the point's own distance.
+struct ShadowMapOptions {
+    std::optional<int> resolution = std::nullopt;
+    double bias = 0.02;
+};
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // Find camera ray hits by rasterizing the scene into a visibility buffer instead of tracing.
+    bool rasterize_primary = false;
+    CostMetric cost_metric = CostMetric::kRays;
+    // Trace only these pixels of the screen; camera rays are the same as in the full frame.
+    std::optional<CropWindow> crop = std::nullopt;
+    std::optional<ShadowMapOptions> shadow_maps = std::nullopt;
+    // Rows of the frame are traced on this many threads.
+    size_t num_threads = 1;
+    // Shade with the approximations of fast_math.h, a table-based pow for specular highlights
+    // and rsqrt-based normalization of light directions, for previews. Pixels of the test scenes
+    // stay within 1% of the exact render.
+    bool fast_math = false;
+    // What kFull tone mapping, kDepth scaling and the kCost ramp normalize by instead of the
+    // maximum of the traced pixels. Tiles of a frame post-processed with the maximum of
+    // GetNormalization() over all of them join up into the full frame without seams.
+    std::optional<double> normalization = std::nullopt;
 };
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+size_t GetNumThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits [0, size) into at most num_blocks contiguous blocks of at least min_block items and
+// calls func(block, block_begin, block_end) for each of them on its own thread. Returns the
+// number of blocks used.
+template <class F>
+size_t ParallelBlocks(size_t size, size_t min_block, F&& func,
+                      size_t num_blocks = GetNumThreads()) {
+    num_blocks = std::max<size_t>(1, std::min(num_blocks, size / std::max<size_t>(min_block, 1)));
+    if (num_blocks == 1) {
+        func(0, 0, size);
+        return 1;
+    }
+
+    std::vector<std::exception_ptr> errors(num_blocks);
+    std::vector<std::thread> workers;
+    for (size_t block = 0; block < num_blocks; ++block) {
+        workers.emplace_back([&, block] {
+            try {
+                func(block, size * block / num_blocks, size * (block + 1) / num_blocks);
+            } catch (...) {
+                errors[block] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return num_blocks;
+}
@@ -1,12 +1,20 @@
+#pragma once
+
 #include <intersection.h>
 #include <ray.h>
 #include <scene.h>
+#include <out_of_core_scene.h>
 #include <vector.h>
 #include <object.h>
 #include <geometry.h>
+#include <fast_math.h>
 #include <optional>
+#include <algorithm>
+#include <utility>
+#include <vector>
 #include <tuple>
 #include <cmath>
+#include <cstdint>
 #include <material.h>
 #include <image.h>
 #include <options/camera_options.h>
@@ -15,7 +23,18 @@
 #define UNUSED(x) (void)(x)
 constexpr double kEps = 1e-6;
 
-Vector GetNormal(const Intersection& intersection, const Object& object) {
+// Work done by the tracing calls of the current thread, read by the kCost render mode.
+struct TraceCounters {
+    uint64_t rays = 0;
+    uint64_t primitive_tests = 0;
+};
+
+TraceCounters& GetTraceCounters() {
+    thread_local TraceCounters counters;
+    return counters;
+}
+
+RAYTRACER_KERNEL Vector GetNormal(const Intersection& intersection, const Object& object) {
     if (!object.NormalExists()) {
         return intersection.GetNormal();
     } else {
@@ -28,25 +47,163 @@ Vector GetNormal(const Intersection& intersection, const Object& object) {
     }
 }
 
+// Interpolates within the fan triangle that contains the hit, as the triangulated face would;
+// the result differs from the triangle's only by the rounding of the hit point.
+Vector GetNormal(const Intersection& intersection, const PolygonObject& object,
+                 const PolygonPool& pool) {
+    if (!object.NormalExists()) {
+        return intersection.GetNormal();
+    }
+    size_t fan = 1;
+    Vector barycentric =
+        GetFanBarycentricCoords(pool.GetPolygon(object), intersection.GetPosition(), &fan);
+    return barycentric[0] * pool.GetNormal(object, 0) +
+           barycentric[1] * pool.GetNormal(object, fan) +
+           barycentric[2] * pool.GetNormal(object, fan + 1);
+}
+
 Vector GetNormal(const Intersection& intersection, const SphereObject& object) {
     UNUSED(object);
     return intersection.GetNormal();
 }
 
-std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(const Ray& ray,
-                                                                           const Scene& scene) {
-    // find closest intersection
+template <class T>
+std::tuple<Intersection, const Material*, Vector> MakeIntersectionInfo(
+    const Intersection& intersection, const T& object) {
+    return std::make_tuple(intersection, object.material,
+                           GetNormal(intersection, object).Normalized());
+}
+
+using HitInfo = std::optional<std::tuple<Intersection, const Material*, Vector>>;
+
+RAYTRACER_KERNEL HitInfo IntersectSceneImpl(const Ray& ray, const Scene& scene, int* primitive) {
+
+    auto& counters = GetTraceCounters();
+    ++counters.rays;
+    counters.primitive_tests += scene.GetObjects().size() + scene.GetPolygonObjects().size() +
+                                scene.GetSphereObjects().size();
 
     std::optional<Intersection> closest_intersection = std::nullopt;
-    const Material* material;
+    const Material* material = nullptr;
     Vector normal;
 
+    int closest_primitive = -1, current_primitive = 0;
+
     for (const auto& obj : scene.GetObjects()) {
         auto intersection = GetIntersection(ray, obj.polygon);
         if (intersection && (!closest_intersection || intersection < closest_intersection)) {
             closest_intersection = intersection;
             material = obj.material;
             normal = GetNormal(intersection.value(), obj);
+            closest_primitive = current_primitive;
+        }
+        ++current_primitive;
+    }
+
+    const auto& polygons = scene.GetPolygonPool();
+    for (const auto& obj : polygons.objects) {
+        auto intersection = GetIntersection(ray, polygons.GetPolygon(obj));
+        if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+            closest_intersection = intersection;
+            material = obj.material;
+            normal = GetNormal(intersection.value(), obj, polygons);
+            closest_primitive = current_primitive;
+        }
+        ++current_primitive;
+    }
+
+    for (const auto& obj : scene.GetSphereObjects()) {
+        auto intersection = GetIntersection(ray, obj.sphere);
+        if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+            closest_intersection = intersection;
+            material = obj.material;
+            normal = GetNormal(intersection.value(), obj);
+            closest_primitive = current_primitive;
+        }
+        ++current_primitive;
+    }
+
+    if (primitive) {
+        *primitive = closest_primitive;
+    }
+
+    if (closest_intersection) {
+        return std::make_tuple(closest_intersection.value(), material, normal.Normalized());
+    } else {
+        return std::nullopt;
+    }
+}
+
+// The linear scan over all primitives, with the primitive tests inlined, built per ISA.
+RAYTRACER_DEFINE_KERNEL(HitInfo, IntersectScene, IntersectSceneImpl,
+                        (const Ray& ray, const Scene& scene, int* primitive),
+                        (ray, scene, primitive))
+
+// The id of the closest primitive is stored into primitive if given, numbered as in
+// VisibilityBuffer: triangles first, then polygons, then spheres.
+std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(
+    const Ray& ray, const Scene& scene, int* primitive = nullptr) {
+    return IntersectScene(ray, scene, primitive);
+}
+
+// Walks the hierarchy over the cluster bounds front to back and skips every subtree the ray
+// enters beyond the closest hit found so far. Slab tests grow with the depth of the hierarchy
+// instead of the number of clusters, and page-ins stay with the clusters rays actually reach.
+std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(
+    const Ray& ray, const OutOfCoreScene& scene) {
+
+    auto& counters = GetTraceCounters();
+    ++counters.rays;
+    counters.primitive_tests += scene.GetSphereObjects().size();
+
+    std::optional<Intersection> closest_intersection = std::nullopt;
+    const Material* material = nullptr;
+    Vector normal;
+
+    // Nodes to visit with the distances at which the ray enters them, nearest on top.
+    thread_local std::vector<std::pair<double, uint32_t>> stack;
+    stack.clear();
+    const auto& nodes = scene.GetClusterNodes();
+    if (!nodes.empty()) {
+        if (auto distance = GetIntersectionDistance(ray, nodes[0].bounds)) {
+            stack.emplace_back(distance.value(), 0);
+        }
+    }
+
+    while (!stack.empty()) {
+        auto [entry_distance, index] = stack.back();
+        stack.pop_back();
+        if (closest_intersection && entry_distance > closest_intersection->GetDistance()) {
+            continue;
+        }
+
+        const auto& node = nodes[index];
+        if (!node.is_leaf) {
+            auto near = GetIntersectionDistance(ray, nodes[node.first].bounds);
+            auto far = GetIntersectionDistance(ray, nodes[node.first + 1].bounds);
+            uint32_t near_index = node.first, far_index = node.first + 1;
+            if (near && far && far.value() < near.value()) {
+                std::swap(near, far);
+                std::swap(near_index, far_index);
+            }
+            if (far) {
+                stack.emplace_back(far.value(), far_index);
+            }
+            if (near) {
+                stack.emplace_back(near.value(), near_index);
+            }
+            continue;
+        }
+
+        auto cluster = scene.GetCluster(node.first);
+        counters.primitive_tests += cluster->size();
+        for (const auto& obj : *cluster) {
+            auto intersection = GetIntersection(ray, obj.polygon);
+            if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+                closest_intersection = intersection;
+                material = obj.material;
+                normal = GetNormal(intersection.value(), obj);
+            }
         }
     }
 
@@ -66,7 +223,71 @@ std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(const
     }
 }
 
-bool IsShadowed(const Ray& ray, const Scene& scene, double len) {
+// Tests each mesh at the level of detail picked for the ray, after a bounding sphere check.
+std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(
+    const Ray& ray, const LodSceneView<Scene>& view) {
+
+    auto& counters = GetTraceCounters();
+    ++counters.rays;
+    counters.primitive_tests +=
+        view.GetScene().GetPolygonObjects().size() + view.GetSphereObjects().size();
+
+    std::optional<Intersection> closest_intersection = std::nullopt;
+    const Material* material = nullptr;
+    Vector normal;
+
+    for (const auto& mesh : view.GetScene().GetLodMeshes()) {
+        auto to_center = mesh.center - ray.GetOrigin();
+        double along = DotProduct(to_center, ray.GetDirection());
+        double squared_miss = DotProduct(to_center, to_center) - along * along;
+        double squared_radius = mesh.radius * mesh.radius;
+        if (squared_miss > squared_radius ||
+            (along < 0 && DotProduct(to_center, to_center) > squared_radius)) {
+            continue;
+        }
+
+        size_t count;
+        const auto* objects = view.SelectLevel(mesh, ray.GetOrigin(), &count);
+        counters.primitive_tests += count;
+        for (size_t i = 0; i < count; ++i) {
+            const auto& obj = objects[i];
+            auto intersection = GetIntersection(ray, obj.polygon);
+            if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+                closest_intersection = intersection;
+                material = obj.material;
+                normal = GetNormal(intersection.value(), obj);
+            }
+        }
+    }
+
+    const auto& polygons = view.GetScene().GetPolygonPool();
+    for (const auto& obj : polygons.objects) {
+        auto intersection = GetIntersection(ray, polygons.GetPolygon(obj));
+        if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+            closest_intersection = intersection;
+            material = obj.material;
+            normal = GetNormal(intersection.value(), obj, polygons);
+        }
+    }
+
+    for (const auto& obj : view.GetSphereObjects()) {
+        auto intersection = GetIntersection(ray, obj.sphere);
+        if (intersection && (!closest_intersection || intersection < closest_intersection)) {
+            closest_intersection = intersection;
+            material = obj.material;
+            normal = GetNormal(intersection.value(), obj);
+        }
+    }
+
+    if (closest_intersection) {
+        return std::make_tuple(closest_intersection.value(), material, normal.Normalized());
+    } else {
+        return std::nullopt;
+    }
+}
+
+template <class SceneT>
+bool IsShadowed(const Ray& ray, const SceneT& scene, double len) {
     auto intersection_info = Intersect(ray, scene);
     if (intersection_info) {
         const auto& [intersection, _, __] = intersection_info.value();
@@ -76,93 +297,162 @@ bool IsShadowed(const Ray& ray, const Scene& scene, double len) {
     }
 }
 
+// Point on the outer side of a hit from which shadow rays start.
+Vector GetShadowRayOrigin(const Intersection& intersection, const Vector& norm) {
+    return intersection.GetPosition() + kEps * norm;
+}
+
+template <class SceneT>
+bool IsLightShadowed(const Vector& pos, const Light& light, const SceneT& scene) {
+    Vector light_dir = (light.position - pos).Normalized();
+    return IsShadowed(Ray{pos, light_dir}, scene, Length(light.position - pos));
+}
+
+RAYTRACER_KERNEL Vector CalculateLightContributionImpl(const Vector& pos, const Light& light,
+                                                       const Material* material,
+                                                       const Vector& norm, const Ray& ray,
+                                                       bool fast_math) {
+    Vector to_light = light.position - pos;
+    Vector light_dir = fast_math ? FastNormalized(to_light) : to_light.Normalized();
+
+    double cos = std::max(0., DotProduct(norm, light_dir));
+    Vector light_color;
+    light_color.AddScaledProduct(light.intensity, material->diffuse_color, cos);
+
+    Vector reflected_ray = Reflect(light_dir, norm);
+    double specular_cos = std::max(0., DotProduct(reflected_ray, ray.GetDirection()));
+    double specular = fast_math ? FastPow(specular_cos, material->specular_exponent)
+                                : pow(specular_cos, material->specular_exponent);
+    return light_color.AddScaledProduct(light.intensity, material->specular_color, specular);
+}
+
+// Diffuse and specular contribution of an unoccluded light.
+RAYTRACER_DEFINE_KERNEL(Vector, CalculateLightContribution, CalculateLightContributionImpl,
+                        (const Vector& pos, const Light& light, const Material* material,
+                         const Vector& norm, const Ray& ray, bool fast_math),
+                        (pos, light, material, norm, ray, fast_math))
+
+template <class SceneT>
 Vector CalculatePointLight(std::tuple<Intersection, const Material*, Vector> intersection_info,
-                           const Scene& scene, const Ray& ray) {
+                           const SceneT& scene, const Ray& ray,
+                           const RenderOptions& render_options) {
 
     const auto& [intersection, material, norm] = intersection_info;
 
     Vector sum_light;
     for (auto& light : scene.GetLights()) {
-        Vector pos = intersection.GetPosition() + kEps * norm;
-
-        Vector light_dir = (light.position - pos).Normalized();
+        Vector pos = GetShadowRayOrigin(intersection, norm);
 
-        if (IsShadowed(Ray{pos, light_dir}, scene, Length(light.position - pos))) {
+        if (IsLightShadowed(pos, light, scene)) {
             continue;
         }
 
-        double cos = std::max(0., DotProduct(norm, light_dir));
-        sum_light += cos * light.intensity * material->diffuse_color;
-
-        Vector reflected_ray = Reflect(light_dir, norm);
-        sum_light += pow(std::max(0., DotProduct(reflected_ray, ray.GetDirection())),
-                         material->specular_exponent) *
-                     light.intensity * material->specular_color;
+        sum_light +=
+            CalculateLightContribution(pos, light, material, norm, ray, render_options.fast_math);
     }
 
     return sum_light;
 }
 
-const Vector CalculateRay(const Ray& ray, const Scene& scene, const RenderOptions& render_options,
-                          int depth = 0, bool inside = false) {
+template <class SceneT>
+const Vector CalculateRay(const Ray& ray, const SceneT& scene,
+                          const RenderOptions& render_options, int depth = 0, bool inside = false);
 
-    if (depth == render_options.depth) {
-        return {0, 0, 0};
+const Vector CalculateMiss(const RenderOptions& render_options) {
+    if (render_options.mode == RenderMode::kNormal) {
+        return Vector{0, 0, 0};
     }
+    if (render_options.mode == RenderMode::kDepth) {
+        return Vector{-1, -1, -1};
+    }
+    return Vector{0, 0, 0};
+}
 
-    auto intersection_info = Intersect(ray, scene);
-    if (!intersection_info) {
-        if (render_options.mode == RenderMode::kNormal) {
-            return Vector{0, 0, 0};
-        }
-        if (render_options.mode == RenderMode::kDepth) {
-            return Vector{-1, -1, -1};
-        }
-        return Vector{0, 0, 0};
-    } else {
+// Colors seen along the mirror and refracted directions of a hit, with the refracted one already
+// weighted. Materials without a reflective or refractive albedo trace nothing.
+template <class SceneT>
+std::pair<Vector, Vector> CalculateSecondary(
+    const Ray& ray, const std::tuple<Intersection, const Material*, Vector>& intersection_info,
+    const SceneT& scene, const RenderOptions& render_options, int depth, bool inside) {
+
+    const auto& [intersection, material, norm] = intersection_info;
+
+    Vector reflection;
+    if (material->albedo[1] != 0) {
+        reflection = CalculateRay(
+            Ray{intersection.GetPosition() + kEps * norm, Reflect(ray.GetDirection(), norm)},
+            scene, render_options, depth + 1, inside);
+    }
+
+    Vector refraction;
 
-        const auto& [intersection, material, norm] = intersection_info.value();
+    if (material->albedo[2] > 0 and depth < render_options.depth) {
+        double r = material->refraction_index;
 
-        if (render_options.mode == RenderMode::kNormal) {
-            return Vector{(norm[0] / 2 + 0.5), (norm[1] / 2 + 0.5), (norm[2] / 2 + 0.5)};
+        if (!inside) {
+            r = 1 / r;
         }
 
-        if (render_options.mode == RenderMode::kDepth) {
-            return Vector{intersection.GetDistance(), intersection.GetDistance(),
-                          intersection.GetDistance()};
+        auto refract_dir = Refract(ray.GetDirection(), norm, r);
+        if (refract_dir) {
+            auto refracted_ray = Ray{intersection.GetPosition() - kEps * norm, refract_dir.value()};
+
+            auto alb = material->albedo[2];
+            if (inside) {
+                alb = 1;
+            }
+            refraction =
+                alb * CalculateRay(refracted_ray, scene, render_options, depth + 1, !inside);
         }
+    }
 
-        Vector reflection;
-        reflection = CalculateRay(
-            Ray{intersection.GetPosition() + kEps * norm, Reflect(ray.GetDirection(), norm)}, scene,
-            render_options, depth + 1, inside);
+    return {reflection, refraction};
+}
+
+Vector ShadeHit(const Material& material, const Vector& light, const Vector& reflection,
+                const Vector& refraction) {
+    Vector color = material.ambient_color + material.intensity;
+    color.AddScaled(light, material.albedo[0]).AddScaled(reflection, material.albedo[1]);
+    return color += refraction;
+}
 
-        Vector light = CalculatePointLight(intersection_info.value(), scene, ray);
+// Shades a known closest hit of the ray; secondary rays are traced from it as usual.
+template <class SceneT>
+const Vector CalculateHit(
+    const Ray& ray, const std::tuple<Intersection, const Material*, Vector>& intersection_info,
+    const SceneT& scene, const RenderOptions& render_options, int depth = 0, bool inside = false) {
 
-        Vector refraction;
+    const auto& [intersection, material, norm] = intersection_info;
 
-        if (material->albedo[2] > 0 and depth < render_options.depth) {
-            double r = material->refraction_index;
+    if (render_options.mode == RenderMode::kNormal) {
+        return Vector{(norm[0] / 2 + 0.5), (norm[1] / 2 + 0.5), (norm[2] / 2 + 0.5)};
+    }
 
-            if (!inside) {
-                r = 1 / r;
-            }
+    if (render_options.mode == RenderMode::kDepth) {
+        return Vector{intersection.GetDistance(), intersection.GetDistance(),
+                      intersection.GetDistance()};
+    }
 
-            auto refract_dir = Refract(ray.GetDirection(), norm, r);
-            if (refract_dir) {
-                auto refracted_ray =
-                    Ray{intersection.GetPosition() - kEps * norm, refract_dir.value()};
-
-                auto alb = material->albedo[2];
-                if (inside) {
-                    alb = 1;
-                }
-                refraction =
-                    alb * CalculateRay(refracted_ray, scene, render_options, depth + 1, !inside);
-            }
-        }
+    auto [reflection, refraction] =
+        CalculateSecondary(ray, intersection_info, scene, render_options, depth, inside);
+
+    Vector light = CalculatePointLight(intersection_info, scene, ray, render_options);
+
+    return ShadeHit(*material, light, reflection, refraction);
+}
+
+template <class SceneT>
+const Vector CalculateRay(const Ray& ray, const SceneT& scene,
+                          const RenderOptions& render_options, int depth, bool inside) {
 
-        return material->ambient_color + material->intensity + material->albedo[0] * light +
-               material->albedo[1] * reflection + refraction;
+    if (depth == render_options.depth) {
+        return {0, 0, 0};
+    }
+
+    auto intersection_info = Intersect(ray, scene);
+    if (!intersection_info) {
+        return CalculateMiss(render_options);
+    } else {
+        return CalculateHit(ray, intersection_info.value(), scene, render_options, depth, inside);
     }
 }
@@ -1,9 +1,12 @@
+#pragma once
+
 #include <intersection.h>
 #include <ray.h>
 #include <scene.h>
 #include <vector.h>
 #include <object.h>
 #include <geometry.h>
+#include <cpu_dispatch.h>
 #include <optional>
 #include <tuple>
 #include <cmath>
@@ -11,105 +14,254 @@
 #include <image.h>
 #include <options/camera_options.h>
 #include <options/render_options.h>
+#include <framebuffer.h>
+#include <parallel.h>
+#include <trace_recorder.h>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <vector>
 
-std::vector<std::vector<Vector>> ToneMapping(std::vector<std::vector<Vector>>& pixels) {
-    auto max = 0.;
+// Rows of the framebuffer are processed in parallel; each row is handled in one pass while
+// it's still in cache.
+constexpr size_t kMinRowsPerThread = 64;
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            for (size_t i = 0; i < 3; ++i) {
-                max = std::max(max, pixels[x][y][i]);
-            }
+// The four independent accumulators let the compiler vectorize the loop.
+RAYTRACER_KERNEL double GetRowMaxImpl(const double* data, size_t size, double initial) {
+    double max[4] = {initial, initial, initial, initial};
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        for (size_t k = 0; k < 4; ++k) {
+            max[k] = max[k] < data[i + k] ? data[i + k] : max[k];
         }
     }
+    for (; i < size; ++i) {
+        max[0] = max[0] < data[i] ? data[i] : max[0];
+    }
+    return std::max({max[0], max[1], max[2], max[3]});
+}
 
-    if (max == 0) {
-        return pixels;
-    }  // full black image
+RAYTRACER_DEFINE_KERNEL(double, GetRowMax, GetRowMaxImpl,
+                        (const double* data, size_t size, double initial), (data, size, initial))
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            auto v_in = pixels[x][y];
-            auto v_out = v_in * (1. + v_in / (max * max)) / (1. + v_in);
+// Maximum over all channels of all pixels, reduced in parallel.
+double GetMaxChannel(const Framebuffer& pixels) {
+    TraceScope trace("GetMaxChannel");
+    std::vector<double> block_max(GetNumThreads(), 0.);
 
-            pixels[x][y] = v_out;
+    auto reduce = [&](size_t block, size_t begin, size_t end) {
+        double max = 0.;
+        for (auto y = begin; y < end; ++y) {
+            max = GetRowMax(pixels.RowData(y), static_cast<size_t>(pixels.Width()) * 3, max);
         }
-    }
+        block_max[block] = max;
+    };
+    auto num_blocks = ParallelBlocks(pixels.Height(), kMinRowsPerThread, reduce);
 
-    return pixels;
+    return *std::max_element(block_max.begin(), block_max.begin() + num_blocks);
 }
 
 int GetGammaColor(double color) {
     return std::pow(color, 1 / 2.2) * 255;
 }
 
-std::vector<std::vector<RGB>> GammaCorrection(std::vector<std::vector<Vector>>& pixels) {
-    std::vector<std::vector<RGB>> result(pixels.size(), std::vector<RGB>(pixels[0].size()));
+double ToneMap(double color, double inv_max_squared) {
+    return color * (1. + color * inv_max_squared) / (1. + color);
+}
+
+// GetGammaColor(color) without calling std::pow and without branches, so that rows of it
+// vectorize. The power is 2^(log2(color) / 2.2) in single precision, with log2 from the atanh
+// series on the mantissa and 2^x from its Taylor series, and comes within 1e-4 of the exact one.
+// Inputs whose result lies within kEps of a whole level, or outside [0, 1), give -1 and have to
+// go through GetGammaColor. That is about one input in a thousand.
+RAYTRACER_KERNEL int GetGammaColorEstimate(float color) {
+    constexpr int32_t kMinBits = 0x30800000;  // 2^-30, which is far below level 1
+    constexpr int32_t kMaxBits = 0x3f7fffff;  // the largest float below 1
+    constexpr float kEps = 5e-4f;
+    // Adding kRound rounds a float to an integer, which ends up in the low mantissa bits.
+    constexpr float kRound = 0x1.8p23f;
+    constexpr int32_t kRoundBits = 0x4b400000;
+
+    bool in_range = (color >= 0) & (color < 1);
+    auto bits = std::bit_cast<int32_t>(color);
+    bits = bits > kMinBits ? bits : kMinBits;
+    bits = bits < kMaxBits ? bits : kMaxBits;
+
+    // color = m * 2^exponent with m in [sqrt(1/2), sqrt(2)).
+    auto exponent = (bits - 0x3f3504f3) >> 23;
+    auto m = std::bit_cast<float>(bits - (exponent << 23));
+    float s = (m - 1) / (m + 1);
+    float s2 = s * s;
+    float ln_m = 2 * s * (1 + s2 * (1.f / 3 + s2 * (1.f / 5 + s2 * (1.f / 7))));
+    float power = (ln_m * 1.44269504f + (std::bit_cast<float>(kRoundBits + exponent) - kRound)) *
+                  (1 / 2.2f);
+
+    // 2^power = 2^n * e^(x ln 2) with n the nearest integer.
+    float n = power + kRound;
+    float x = (power - (n - kRound)) * 0.693147181f;
+    float exp_x =
+        1 + x * (1 + x * (1.f / 2 + x * (1.f / 6 + x * (1.f / 24 + x * (1.f / 120 + x / 720)))));
+    float scale = std::bit_cast<float>((std::bit_cast<int32_t>(n) - kRoundBits + 127) << 23);
+    float level = exp_x * scale * 255;
+
+    float rounded = (level - 0.5f) + kRound;
+    float frac = level - (rounded - kRound);
+    bool exact = in_range & (frac > kEps) & (frac < 1 - kEps);
+    return exact ? std::bit_cast<int32_t>(rounded) - kRoundBits : -1;
+}
+
+// GetGammaColor(ToneMap(color)) of a row of channels. The estimate gets the tone mapped value
+// in single precision, which is well within its margin, and the few channels it's unsure of are
+// redone exactly in blocks the size of kBlock.
+RAYTRACER_KERNEL void ToneMapGammaRowImpl(const double* data, int* levels, size_t size,
+                                          double inv_max_squared) {
+    auto inv_max_squared_f = static_cast<float>(inv_max_squared);
+    for (size_t i = 0; i < size; ++i) {
+        auto v = static_cast<float>(data[i]);
+        levels[i] = GetGammaColorEstimate(v * (1 + v * inv_max_squared_f) / (1 + v));
+    }
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            for (size_t i = 0; i < 3; ++i) {
-                RGB rgb{GetGammaColor(pixels[x][y][0]), GetGammaColor(pixels[x][y][1]),
-                        GetGammaColor(pixels[x][y][2])};
-                result[x][y] = rgb;
+    constexpr size_t kBlock = 64;
+    for (size_t begin = 0; begin < size; begin += kBlock) {
+        auto end = std::min(begin + kBlock, size);
+        int any_unsure = 0;
+        for (auto i = begin; i < end; ++i) {
+            any_unsure |= levels[i];
+        }
+        if (any_unsure >= 0) {
+            continue;
+        }
+        for (auto i = begin; i < end; ++i) {
+            if (levels[i] < 0) {
+                levels[i] = GetGammaColor(ToneMap(data[i], inv_max_squared));
             }
         }
     }
-
-    return result;
 }
 
-std::vector<std::vector<RGB>> PostProcess(std::vector<std::vector<Vector>>& pixels) {
+RAYTRACER_DEFINE_KERNEL(void, ToneMapGammaRow, ToneMapGammaRowImpl,
+                        (const double* data, int* levels, size_t size, double inv_max_squared),
+                        (data, levels, size, inv_max_squared))
 
-    auto tone_mapped = ToneMapping(pixels);
-    return GammaCorrection(tone_mapped);
-}
+// Tone mapping followed by gamma correction, fused into a single pass over the framebuffer.
+// The white point is max, or the brightest channel of the pixels if not given.
+void PostProcess(const Framebuffer& pixels, Image* image,
+                 std::optional<double> max_channel = std::nullopt) {
+    auto max = max_channel ? max_channel.value() : GetMaxChannel(pixels);
 
-std::vector<std::vector<RGB>> PostProcessNormal(std::vector<std::vector<Vector>>& pixels) {
+    TraceScope trace("ToneMapGamma");
 
-    auto get_color = [](double color) -> int { return static_cast<int>(color * 255); };
+    auto size = static_cast<size_t>(pixels.Width()) * 3;
+    ParallelBlocks(pixels.Height(), kMinRowsPerThread, [&](size_t, size_t begin, size_t end) {
+        thread_local std::vector<int> levels;
+        levels.resize(size);
+        for (auto y = begin; y < end; ++y) {
+            const double* data = pixels.RowData(y);
 
-    std::vector<std::vector<RGB>> result(pixels.size(), std::vector<RGB>(pixels[0].size()));
+            if (max == 0) {  // full black image
+                std::transform(data, data + size, levels.begin(), GetGammaColor);
+            } else {
+                ToneMapGammaRow(data, levels.data(), size, 1 / (max * max));
+            }
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            for (size_t i = 0; i < 3; ++i) {
-                RGB rgb{get_color(pixels[x][y][0]), get_color(pixels[x][y][1]),
-                        get_color(pixels[x][y][2])};
-                result[x][y] = rgb;
+            for (int x = 0; x < pixels.Width(); ++x) {
+                image->SetPixel({levels[3 * x], levels[3 * x + 1], levels[3 * x + 2]}, y, x);
             }
         }
-    }
+    });
+}
+
+void PostProcessNormal(const Framebuffer& pixels, Image* image) {
+    TraceScope trace("PostProcessNormal");
+
+    auto get_color = [](double color) -> int { return static_cast<int>(color * 255); };
 
-    return result;
+    ParallelBlocks(pixels.Height(), kMinRowsPerThread, [&](size_t, size_t begin, size_t end) {
+        for (auto y = begin; y < end; ++y) {
+            const auto* row = pixels.Row(y);
+            for (int x = 0; x < pixels.Width(); ++x) {
+                image->SetPixel(
+                    {get_color(row[x][0]), get_color(row[x][1]), get_color(row[x][2])}, y, x);
+            }
+        }
+    });
 }
 
-std::vector<std::vector<RGB>> PostProcessDepth(std::vector<std::vector<Vector>>& pixels) {
-    std::vector<std::vector<RGB>> result(pixels.size(), std::vector<RGB>(pixels[0].size()));
+// Largest depth of a hit, or 0 if all pixels are misses.
+double GetMaxDepth(const Framebuffer& pixels) {
+    std::vector<double> block_max(GetNumThreads(), 0.);
 
-    auto get_color = [](double color, double d) -> int {
-        if (color == -1) {
-            return 1 * 255;
+    auto reduce = [&](size_t block, size_t begin, size_t end) {
+        double d = 0.;
+        for (auto y = begin; y < end; ++y) {
+            const auto* row = pixels.Row(y);
+            for (int x = 0; x < pixels.Width(); ++x) {
+                if (row[x][0] != -1) {
+                    d = std::max(d, row[x][0]);
+                }
+            }
         }
-        return static_cast<int>(color / d * 255);
+        block_max[block] = d;
     };
+    auto num_blocks = ParallelBlocks(pixels.Height(), kMinRowsPerThread, reduce);
+    return *std::max_element(block_max.begin(), block_max.begin() + num_blocks);
+}
 
-    auto d = 0.;
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            if (pixels[x][y][0] != -1) {
-                d = std::max(d, pixels[x][y][0]);
+// Depths are scaled by max_depth, or the largest depth of the pixels if not given.
+void PostProcessDepth(const Framebuffer& pixels, Image* image,
+                      std::optional<double> max_depth = std::nullopt) {
+    TraceScope trace("PostProcessDepth");
+    auto d = max_depth ? max_depth.value() : GetMaxDepth(pixels);
+
+    // All three channels hold the same depth, so each pixel is mapped once.
+    ParallelBlocks(pixels.Height(), kMinRowsPerThread, [&](size_t, size_t begin, size_t end) {
+        for (auto y = begin; y < end; ++y) {
+            const auto* row = pixels.Row(y);
+            for (int x = 0; x < pixels.Width(); ++x) {
+                int color = 0;
+                if (row[x][0] == -1) {
+                    color = 255;
+                } else if (d > 0) {
+                    color = static_cast<int>(row[x][0] / d * 255);
+                }
+                image->SetPixel({color, color, color}, y, x);
             }
         }
-    }
+    });
+}
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            RGB rgb{get_color(pixels[x][y][0], d), get_color(pixels[x][y][1], d),
-                    get_color(pixels[x][y][2], d)};
-            result[x][y] = rgb;
-        }
-    }
+// False-color heatmap of a per-pixel cost, scaled so that the most expensive pixel is white.
+// Costs run from black through blue, cyan, green, yellow and red. max_cost overrides the cost
+// that maps to white.
+void PostProcessCost(const Framebuffer& pixels, Image* image,
+                     std::optional<double> max_cost = std::nullopt) {
+    TraceScope trace("PostProcessCost");
+    static constexpr std::array<std::array<double, 3>, 7> kRamp = {{{0, 0, 0},
+                                                                    {0, 0, 255},
+                                                                    {0, 255, 255},
+                                                                    {0, 255, 0},
+                                                                    {255, 255, 0},
+                                                                    {255, 0, 0},
+                                                                    {255, 255, 255}}};
 
-    return result;
+    auto max = max_cost ? max_cost.value() : GetMaxChannel(pixels);
+
+    ParallelBlocks(pixels.Height(), kMinRowsPerThread, [&](size_t, size_t begin, size_t end) {
+        for (auto y = begin; y < end; ++y) {
+            const auto* row = pixels.Row(y);
+            for (int x = 0; x < pixels.Width(); ++x) {
+                double t = max > 0 ? row[x][0] / max * (kRamp.size() - 1) : 0;
+                auto i = std::min(static_cast<size_t>(t), kRamp.size() - 2);
+                double frac = t - i;
+
+                std::array<int, 3> color;
+                for (size_t k = 0; k < 3; ++k) {
+                    color[k] =
+                        static_cast<int>(kRamp[i][k] + frac * (kRamp[i + 1][k] - kRamp[i][k]));
+                }
+                image->SetPixel({color[0], color[1], color[2]}, y, x);
+            }
+        }
+    });
 }
@@ -6,57 +6,261 @@
 
 #include "screen.h"
 
+#include <chrono>
 #include <filesystem>
+#include <type_traits>
+
+#include <float_image.h>
+#include <framebuffer.h>
+#include <render_control.h>
 
 #include <scene.h>
 #include <ray.h>
 #include <geometry.h>
 #include <postprocessor.h>
 #include <pixel_calculator.h>
+#include <shadow_map.h>
+#include <visibility_buffer.h>
 
 #define UNUSED(x) (void)(x)
 
-std::vector<std::vector<Vector>> Raytrace(const Scene& scene, const CameraOptions& camera_options,
-                                          const RenderOptions& render_options) {
+// The pixels that a render traces: the crop window, or the whole screen without one.
+CropWindow GetRenderWindow(const CameraOptions& camera_options,
+                           const RenderOptions& render_options) {
+    if (!render_options.crop) {
+        return {0, 0, camera_options.screen_width, camera_options.screen_height};
+    }
+    const auto& crop = render_options.crop.value();
+    if (crop.x < 0 || crop.y < 0 || crop.width <= 0 || crop.height <= 0 ||
+        crop.x + crop.width > camera_options.screen_width ||
+        crop.y + crop.height > camera_options.screen_height) {
+        throw std::runtime_error("Crop window is outside the screen");
+    }
+    return crop;
+}
 
-    std::vector<std::vector<Vector>> preprocessed_pixels(
-        camera_options.screen_width, std::vector<Vector>(camera_options.screen_height));
+// Cooperative cancellation point of the render loops, before the i-th pixel of a row.
+void CheckRenderControl(const RenderControl* control, int i) {
+    if (control && i % RenderControl::kPixelsPerCheck == 0) {
+        control->Check();
+    }
+}
+
+void ReportRow(RenderControl* control, const CropWindow& window) {
+    if (control) {
+        control->AddCompletedPixels(window.width);
+    }
+}
+
+// Primary hits come from the visibility buffer of the scene, shading from shading_scene, which
+// is the scene itself or a view of it.
+template <class ShadingSceneT>
+Framebuffer RaytraceRasterized(const Scene& scene, const ShadingSceneT& shading_scene,
+                               const CameraOptions& camera_options,
+                               const RenderOptions& render_options,
+                               RenderControl* control = nullptr) {
+
+    auto window = GetRenderWindow(camera_options, render_options);
+    Framebuffer preprocessed_pixels(window.width, window.height);
 
     auto screen = Screen(camera_options);
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            auto ray = Ray{camera_options.look_from, screen.GetPointRay(x, y)};
-            auto color = CalculateRay(ray, scene, render_options);
-            preprocessed_pixels[x][y] = color;
+    auto visibility = RasterizePrimary(
+        scene, screen,
+        PixelRect{window.x, window.y, window.x + window.width - 1, window.y + window.height - 1},
+        control);
+    auto trace_row = [&](int y) {
+        TraceScope trace("Row", y);
+        for (int x = window.x; x < window.x + window.width; ++x) {
+            CheckRenderControl(control, x - window.x);
+            auto ray = screen.GetCameraRay(x, y);
+            auto hit = GetPrimaryHit(visibility, scene, ray, x, y);
+            preprocessed_pixels.At(x - window.x, y - window.y) =
+                hit ? CalculateHit(ray, *hit, shading_scene, render_options)
+                    : CalculateMiss(render_options);
         }
-    }
+        ReportRow(control, window);
+    };
+    ForEachRow(window.y, window.y + window.height, render_options.num_threads, trace_row);
 
     return preprocessed_pixels;
 }
 
-void RenderImage(Image* image, const Scene& scene, const CameraOptions& camera_options,
-                 const RenderOptions& render_options) {
+// Shades every pixel as a full render would and stores the chosen cost metric of the pixel in all
+// three channels instead of its color.
+template <class SceneT>
+Framebuffer RaytraceCost(const SceneT& scene, const CameraOptions& camera_options,
+                         const RenderOptions& render_options, RenderControl* control = nullptr) {
+
+    auto window = GetRenderWindow(camera_options, render_options);
+    Framebuffer costs(window.width, window.height);
+
+    auto shading_options = render_options;
+    shading_options.mode = RenderMode::kFull;
+
+    auto screen = Screen(camera_options);
+    auto trace_row = [&](int y) {
+        TraceScope trace("Row", y);
+        auto& counters = GetTraceCounters();
+        for (int x = window.x; x < window.x + window.width; ++x) {
+            CheckRenderControl(control, x - window.x);
+            auto before = counters;
+            auto start = std::chrono::steady_clock::now();
+
+            auto ray = screen.GetCameraRay(x, y);
+            CalculateRay(ray, scene, shading_options);
+
+            double cost = 0;
+            if (render_options.cost_metric == CostMetric::kRays) {
+                cost = counters.rays - before.rays;
+            } else if (render_options.cost_metric == CostMetric::kPrimitiveTests) {
+                cost = counters.primitive_tests - before.primitive_tests;
+            } else {
+                cost = std::chrono::duration<double, std::nano>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+            }
+            costs.At(x - window.x, y - window.y) = Vector{cost, cost, cost};
+        }
+        ReportRow(control, window);
+    };
+    ForEachRow(window.y, window.y + window.height, render_options.num_threads, trace_row);
+
+    return costs;
+}
+
+// SceneT is a Scene, an OutOfCoreScene, or a LodSceneView or ShadowMappedScene view of a Scene.
+// If a control is given, the render checks it between pixels, and between rows of primitives
+// while building shadow maps or rasterizing primary hits, and reports its progress.
+template <class SceneT>
+Framebuffer Raytrace(const SceneT& scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, RenderControl* control = nullptr) {
+
+    if constexpr (std::is_same_v<SceneT, Scene>) {
+        std::vector<CubeShadowMap> shadow_maps;
+        if (render_options.shadow_maps) {
+            TraceScope trace("BuildShadowMaps");
+            shadow_maps = BuildShadowMaps(scene, render_options.shadow_maps.value(),
+                                          camera_options, control);
+        }
+
+        if (render_options.rasterize_primary && render_options.depth > 0 &&
+            render_options.mode != RenderMode::kCost) {
+            if (render_options.shadow_maps) {
+                ShadowMappedScene shading_scene(scene, shadow_maps);
+                return RaytraceRasterized(scene, shading_scene, camera_options, render_options,
+                                          control);
+            }
+            return RaytraceRasterized(scene, scene, camera_options, render_options, control);
+        }
+
+        double pixel_angle = camera_options.fov / camera_options.screen_height;
+        LodSceneView lod_view(scene, pixel_angle, scene.GetLodOptions());
+        bool use_lods = !scene.GetLodMeshes().empty();
+        if (render_options.shadow_maps) {
+            if (use_lods) {
+                return Raytrace(ShadowMappedScene(lod_view, shadow_maps), camera_options,
+                                render_options, control);
+            }
+            return Raytrace(ShadowMappedScene(scene, shadow_maps), camera_options, render_options,
+                            control);
+        }
+        if (use_lods) {
+            return Raytrace(lod_view, camera_options, render_options, control);
+        }
+    }
+
+    if (render_options.mode == RenderMode::kCost) {
+        return RaytraceCost(scene, camera_options, render_options, control);
+    }
 
-    auto preprocessed_pixels = Raytrace(scene, camera_options, render_options);
-    std::vector<std::vector<RGB>> pixels;
+    auto window = GetRenderWindow(camera_options, render_options);
+    Framebuffer preprocessed_pixels(window.width, window.height);
+
+    auto screen = Screen(camera_options);
+    auto trace_row = [&](int y) {
+        TraceScope trace("Row", y);
+        thread_local RayPacket packet;
+        packet.Clear();
+        screen.GetRayGenerator().GenerateRow(y, window.x, window.x + window.width, &packet);
+        for (size_t i = 0; i < packet.Size(); ++i) {
+            CheckRenderControl(control, static_cast<int>(i));
+            auto color = CalculateRay(packet.GetRay(i), scene, render_options);
+            preprocessed_pixels.At(packet.x[i] - window.x, y - window.y) = color;
+        }
+        ReportRow(control, window);
+    };
+    ForEachRow(window.y, window.y + window.height, render_options.num_threads, trace_row);
+
+    return preprocessed_pixels;
+}
 
+// The value that post-processing in the render mode normalizes the pixels by: the brightest
+// channel, the largest depth or the largest cost. kNormal needs none and gets 0.
+double GetNormalization(const Framebuffer& pixels, const RenderOptions& render_options) {
+    if (render_options.mode == RenderMode::kDepth) {
+        return GetMaxDepth(pixels);
+    }
+    if (render_options.mode == RenderMode::kNormal) {
+        return 0;
+    }
+    return GetMaxChannel(pixels);
+}
+
+void PostProcess(const Framebuffer& pixels, const RenderOptions& render_options, Image* image) {
+    TraceScope trace("PostProcess");
+    const auto& normalization = render_options.normalization;
     if (render_options.mode == RenderMode::kFull) {
-        pixels = PostProcess(preprocessed_pixels);
+        PostProcess(pixels, image, normalization);
     } else if (render_options.mode == RenderMode::kNormal) {
-        pixels = PostProcessNormal(preprocessed_pixels);
+        PostProcessNormal(pixels, image);
     } else if (render_options.mode == RenderMode::kDepth) {
-        pixels = PostProcessDepth(preprocessed_pixels);
+        PostProcessDepth(pixels, image, normalization);
+    } else if (render_options.mode == RenderMode::kCost) {
+        PostProcessCost(pixels, image, normalization);
     } else {
         throw std::runtime_error("Unknown render mode");
     }
+}
+
+// With a crop window the image is either the size of the window, or the size of the screen and
+// only the window is overwritten. Unless render_options.normalization is given, tone mapping and
+// depth scaling are normalized over the traced pixels; with the full frame's normalization a
+// patched region is exactly the same as in the full render.
+template <class SceneT>
+void RenderImage(Image* image, const SceneT& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, RenderControl* control = nullptr) {
+
+    auto preprocessed_pixels = Raytrace(scene, camera_options, render_options, control);
+
+    if (image->Width() == preprocessed_pixels.Width() &&
+        image->Height() == preprocessed_pixels.Height()) {
+        PostProcess(preprocessed_pixels, render_options, image);
+        return;
+    }
 
-    for (size_t x = 0; x < pixels.size(); ++x) {
-        for (size_t y = 0; y < pixels[0].size(); ++y) {
-            image->SetPixel(pixels[x][y], y, x);
+    auto window = GetRenderWindow(camera_options, render_options);
+    if (image->Width() != camera_options.screen_width ||
+        image->Height() != camera_options.screen_height) {
+        throw std::runtime_error("Image size matches neither the screen nor the crop window");
+    }
+    Image region(window.width, window.height);
+    PostProcess(preprocessed_pixels, render_options, &region);
+    for (int y = 0; y < window.height; ++y) {
+        for (int x = 0; x < window.width; ++x) {
+            image->SetPixel(region.GetPixel(y, x), window.y + y, window.x + x);
         }
     }
 }
 
+// Writes the linear framebuffer of the render as is, for pipelines that do their own tone
+// mapping.
+template <class SceneT>
+void RenderFloatImage(const std::filesystem::path& output_path, FloatFormat format,
+                      const SceneT& scene, const CameraOptions& camera_options,
+                      const RenderOptions& render_options) {
+    WriteFloatImage(Raytrace(scene, camera_options, render_options), output_path, format);
+}
+
 Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
 
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class RenderCancelled : public std::runtime_error {
+public:
+    explicit RenderCancelled(const std::string& message) : std::runtime_error(message) {
+    }
+};
+
+// Shared between a running render and its owner: the owner cancels or sets a deadline, the
+// render loop checks in between pixels and reports the pixels it has finished.
+class RenderControl {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Pixels are traced in runs of this many between checks.
+    static constexpr int kPixelsPerCheck = 16;
+
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+    // Must be set before the render starts.
+    void SetDeadline(Clock::time_point deadline) {
+        deadline_ = deadline;
+    }
+
+    // Throws RenderCancelled if the render was cancelled or ran past its deadline.
+    void Check() const {
+        if (IsCancelled()) {
+            throw RenderCancelled("Render cancelled");
+        }
+        if (deadline_ && Clock::now() > deadline_.value()) {
+            throw RenderCancelled("Render deadline exceeded");
+        }
+    }
+
+    void SetTotalPixels(size_t total) {
+        total_.store(total, std::memory_order_relaxed);
+    }
+
+    void AddCompletedPixels(size_t count) {
+        completed_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    size_t GetCompletedPixels() const {
+        return completed_.load(std::memory_order_relaxed);
+    }
+
+    size_t GetTotalPixels() const {
+        return total_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_ = false;
+    std::optional<Clock::time_point> deadline_;
+    std::atomic<size_t> completed_ = 0;
+    std::atomic<size_t> total_ = 0;
+};
+
+// Calls row(y) for y in [begin, end) on num_threads threads, which take rows one at a time so
+// that expensive rows don't leave other threads idle. After the first exception no new rows are
+// started, and the exception is rethrown once all threads stopped.
+template <class F>
+void ForEachRow(int begin, int end, size_t num_threads, F&& row) {
+    if (num_threads <= 1 || end - begin <= 1) {
+        for (int y = begin; y < end; ++y) {
+            row(y);
+        }
+        return;
+    }
+
+    std::atomic<int> next_row = begin;
+    std::atomic<bool> failed = false;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&] {
+        while (!failed.load(std::memory_order_relaxed)) {
+            int y = next_row.fetch_add(1);
+            if (y >= end) {
+                return;
+            }
+            try {
+                row(y);
+            } catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_threads; ++i) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,48 @@
+#include <render_service.h>
+
+#include <pthread.h>
+
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Usage: render_daemon <socket path> [threads] [scene cache limit, MiB]
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <socket path> [threads] [cache MiB]\n";
+        return 1;
+    }
+
+    size_t num_threads = argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+    size_t cache_limit = (argc > 3 ? std::stoul(argv[3]) : 1024) << 20;
+
+    // Termination signals are blocked in every thread and taken by sigwait() on a thread of
+    // their own, where calling Stop() is safe. SIGUSR1 only wakes it up when Serve() returns.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    RenderService service(num_threads, cache_limit);
+    RenderServer render_server(&service, argv[1]);
+
+    std::thread signal_thread([&signals, &render_server] {
+        int signal;
+        sigwait(&signals, &signal);
+        render_server.Stop();
+    });
+
+    int status = 0;
+    try {
+        render_server.Serve();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        status = 1;
+    }
+    pthread_kill(signal_thread.native_handle(), SIGUSR1);
+    signal_thread.join();
+    return status;
+}
@@ -0,0 +1,436 @@
+#pragma once
+
+#include <raytracer.h>
+#include <render_control.h>
+#include <scene_cache.h>
+#include <thread_pool.h>
+
+#include <png.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+enum class OutputFormat { kPng, kRaw, kPfm };
+
+struct RenderJob {
+    std::filesystem::path scene_path;
+    CameraOptions camera_options;
+    RenderOptions render_options;
+    int priority = 0;
+    OutputFormat format = OutputFormat::kPng;
+    // Counted from Submit(); a job that hasn't finished by then fails with RenderCancelled.
+    std::optional<std::chrono::milliseconds> time_limit = std::nullopt;
+    // Lets the submitter cancel the job. Submit() gives the job one if it has none.
+    std::shared_ptr<RenderControl> control = nullptr;
+};
+
+// For kRaw, data holds width * height RGB triples, 8 bits per channel, rows from top to bottom.
+// kPfm is the linear framebuffer as a PFM file, without any post-processing.
+struct RenderResult {
+    int width;
+    int height;
+    OutputFormat format;
+    std::vector<uint8_t> data;
+};
+
+std::vector<uint8_t> GetRawPixels(const Image& image) {
+    std::vector<uint8_t> data;
+    data.reserve(static_cast<size_t>(image.Width()) * image.Height() * 3);
+    for (int y = 0; y < image.Height(); ++y) {
+        for (int x = 0; x < image.Width(); ++x) {
+            auto pixel = image.GetPixel(y, x);
+            data.push_back(static_cast<uint8_t>(std::clamp(pixel.r, 0, 255)));
+            data.push_back(static_cast<uint8_t>(std::clamp(pixel.g, 0, 255)));
+            data.push_back(static_cast<uint8_t>(std::clamp(pixel.b, 0, 255)));
+        }
+    }
+    return data;
+}
+
+std::vector<uint8_t> EncodePng(const Image& image) {
+    auto raw = GetRawPixels(image);
+
+    png_image png;
+    std::memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    png.width = image.Width();
+    png.height = image.Height();
+    png.format = PNG_FORMAT_RGB;
+
+    png_alloc_size_t size = 0;
+    if (!png_image_write_to_memory(&png, nullptr, &size, 0, raw.data(), 0, nullptr)) {
+        throw std::runtime_error("Can't encode png: " + std::string(png.message));
+    }
+    std::vector<uint8_t> data(size);
+    if (!png_image_write_to_memory(&png, data.data(), &size, 0, raw.data(), 0, nullptr)) {
+        throw std::runtime_error("Can't encode png: " + std::string(png.message));
+    }
+    data.resize(size);
+    return data;
+}
+
+// Runs render jobs on a shared thread pool against resident scenes, so a repeated request for
+// a hot scene costs only the tracing itself.
+class RenderService {
+public:
+    RenderService(size_t num_threads, size_t cache_memory_limit)
+        : cache_(cache_memory_limit), pool_(num_threads) {
+    }
+
+    std::future<RenderResult> Submit(RenderJob job) {
+        if (!job.control) {
+            job.control = std::make_shared<RenderControl>();
+        }
+        if (job.time_limit) {
+            job.control->SetDeadline(RenderControl::Clock::now() + job.time_limit.value());
+        }
+        auto priority = job.priority;
+        return pool_.Submit([this, job = std::move(job)] { return Run(job); }, priority);
+    }
+
+    const SceneCache& GetCache() const {
+        return cache_;
+    }
+
+private:
+    RenderResult Run(const RenderJob& job) {
+        // The job may have been cancelled or run out of time while it was queued.
+        job.control->Check();
+        auto scene = cache_.Get(job.scene_path);
+
+        const auto& camera_options = job.camera_options;
+        if (job.format == OutputFormat::kPfm) {
+            auto pixels = Raytrace(*scene, camera_options, job.render_options, job.control.get());
+            RenderResult result{pixels.Width(), pixels.Height(), job.format, {}};
+            result.data.resize(
+                GetFloatImageSize(pixels.Width(), pixels.Height(), FloatFormat::kPfm));
+            auto* data = reinterpret_cast<char*>(result.data.data());
+            EncodeFloatImage(pixels, FloatFormat::kPfm, data);
+            return result;
+        }
+
+        Image image(camera_options.screen_width, camera_options.screen_height);
+        RenderImage(&image, *scene, camera_options, job.render_options, job.control.get());
+
+        RenderResult result{image.Width(), image.Height(), job.format, {}};
+        if (job.format == OutputFormat::kPng) {
+            result.data = EncodePng(image);
+        } else {
+            result.data = GetRawPixels(image);
+        }
+        return result;
+    }
+
+    SceneCache cache_;
+    ThreadPool pool_;
+};
+
+// Line-based protocol over a unix domain socket. Each request is a single line
+//
+//   render <priority> <format> <width> <height> <fov> <from xyz> <to xyz> <depth> <mode> <path>
+//
+// where format is one of png, raw, pfm, mode is one of full, normal, depth, or cost-rays,
+// cost-tests, cost-time for the cost heatmap, and the scene path takes the rest of the line.
+// The path may be preceded by deadline=<milliseconds>, which fails the render if it hasn't
+// finished that long after the request was read. The reply is either
+// "ok <width> <height> <size>\n" followed by size bytes of image data, or "error <message>\n".
+// A connection may carry any number of requests; closing it cancels the render in progress.
+RenderJob ParseRenderJob(const std::string& line) {
+    std::istringstream iss{line};
+    std::string command, format, mode;
+    RenderJob job;
+    auto& camera = job.camera_options;
+
+    iss >> command >> job.priority >> format >> camera.screen_width >> camera.screen_height >>
+        camera.fov;
+    for (size_t i = 0; i < 3; ++i) {
+        iss >> camera.look_from[i];
+    }
+    for (size_t i = 0; i < 3; ++i) {
+        iss >> camera.look_to[i];
+    }
+    iss >> job.render_options.depth >> mode >> std::ws;
+    std::string path;
+    std::getline(iss, path);
+
+    constexpr std::string_view kDeadline = "deadline=";
+    if (path.starts_with(kDeadline)) {
+        std::istringstream deadline{path.substr(kDeadline.size())};
+        int64_t milliseconds = -1;
+        deadline >> milliseconds;
+        if (deadline.fail() || milliseconds < 0 || deadline.peek() != ' ') {
+            throw std::runtime_error("Bad deadline");
+        }
+        job.time_limit = std::chrono::milliseconds(milliseconds);
+        path.clear();
+        std::getline(deadline >> std::ws, path);
+    }
+
+    if (command != "render" || iss.fail() || path.empty()) {
+        throw std::runtime_error("Malformed request");
+    }
+    if (camera.screen_width <= 0 || camera.screen_height <= 0) {
+        throw std::runtime_error("Bad resolution");
+    }
+
+    if (format == "png") {
+        job.format = OutputFormat::kPng;
+    } else if (format == "raw") {
+        job.format = OutputFormat::kRaw;
+    } else if (format == "pfm") {
+        job.format = OutputFormat::kPfm;
+    } else {
+        throw std::runtime_error("Unknown output format " + format);
+    }
+
+    if (mode == "full") {
+        job.render_options.mode = RenderMode::kFull;
+    } else if (mode == "normal") {
+        job.render_options.mode = RenderMode::kNormal;
+    } else if (mode == "depth") {
+        job.render_options.mode = RenderMode::kDepth;
+    } else if (mode == "cost-rays") {
+        job.render_options.mode = RenderMode::kCost;
+        job.render_options.cost_metric = CostMetric::kRays;
+    } else if (mode == "cost-tests") {
+        job.render_options.mode = RenderMode::kCost;
+        job.render_options.cost_metric = CostMetric::kPrimitiveTests;
+    } else if (mode == "cost-time") {
+        job.render_options.mode = RenderMode::kCost;
+        job.render_options.cost_metric = CostMetric::kTime;
+    } else {
+        throw std::runtime_error("Unknown render mode " + mode);
+    }
+
+    job.scene_path = path;
+    return job;
+}
+
+// Serves each client on its own thread, with at most max_clients connected at once; further
+// clients wait in the listen backlog until one of them disconnects.
+class RenderServer {
+public:
+    RenderServer(RenderService* service, const std::filesystem::path& socket_path,
+                 size_t max_clients = 64)
+        : service_(service),
+          socket_path_(socket_path),
+          max_clients_(std::max<size_t>(max_clients, 1)) {
+
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.string().size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Socket path is too long");
+        }
+        std::strcpy(address.sun_path, socket_path.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            throw std::runtime_error("Can't create socket");
+        }
+        std::filesystem::remove(socket_path);
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            listen(listen_fd_, SOMAXCONN) < 0) {
+            close(listen_fd_);
+            throw std::runtime_error("Can't listen on " + socket_path.string());
+        }
+    }
+
+    RenderServer(const RenderServer&) = delete;
+    RenderServer& operator=(const RenderServer&) = delete;
+
+    ~RenderServer() {
+        Stop();
+        for (auto& connection : connections_) {
+            connection.thread.join();
+        }
+        close(listen_fd_);
+        std::filesystem::remove(socket_path_);
+    }
+
+    // Blocks accepting connections until Stop() is called. Threads of finished connections are
+    // joined as new ones are accepted. Throws on accept() errors other than interruptions and
+    // running out of descriptors, which is retried after a pause.
+    void Serve() {
+        while (true) {
+            {
+                std::unique_lock lock(mutex_);
+                connection_finished_.wait(lock, [this] {
+                    ReapConnections();
+                    return stopped_ || connections_.size() < max_clients_;
+                });
+                if (stopped_) {
+                    break;
+                }
+            }
+
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (stopped_) {
+                    break;
+                }
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+                throw std::runtime_error("accept() failed: " + std::string(std::strerror(errno)));
+            }
+
+            std::lock_guard lock(mutex_);
+            if (stopped_) {
+                close(fd);
+                break;
+            }
+            auto& connection = connections_.emplace_back();
+            connection.fd = fd;
+            connection.thread = std::thread([this, &connection] { HandleConnection(&connection); });
+        }
+    }
+
+    // Cancels the renders of connected clients. Not async-signal-safe: a daemon should call it
+    // from a thread waiting in sigwait().
+    void Stop() {
+        std::lock_guard lock(mutex_);
+        if (stopped_.exchange(true)) {
+            return;
+        }
+        shutdown(listen_fd_, SHUT_RDWR);
+        for (const auto& connection : connections_) {
+            if (!connection.finished) {
+                shutdown(connection.fd, SHUT_RDWR);
+            }
+        }
+        connection_finished_.notify_all();
+    }
+
+    // Connections whose threads haven't been joined yet, finished or not.
+    size_t GetNumConnections() {
+        std::lock_guard lock(mutex_);
+        return connections_.size();
+    }
+
+private:
+    struct Connection {
+        int fd = -1;
+        bool finished = false;
+        std::thread thread;
+    };
+
+    // Joins the threads of finished connections; their threads no longer need mutex_.
+    void ReapConnections() {
+        for (auto it = connections_.begin(); it != connections_.end();) {
+            if (it->finished) {
+                it->thread.join();
+                it = connections_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void HandleConnection(Connection* connection) {
+        int fd = connection->fd;
+        std::string buffer;
+        char chunk[4096];
+        while (true) {
+            auto newline = buffer.find('\n');
+            if (newline == std::string::npos) {
+                auto size = read(fd, chunk, sizeof(chunk));
+                if (size <= 0) {
+                    break;
+                }
+                buffer.append(chunk, size);
+                continue;
+            }
+
+            auto line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+
+            std::string header;
+            std::vector<uint8_t> body;
+            try {
+                auto job = ParseRenderJob(line);
+                auto control = std::make_shared<RenderControl>();
+                job.control = control;
+                auto result = WaitForResult(fd, service_->Submit(std::move(job)), control.get());
+                header = "ok " + std::to_string(result.width) + " " +
+                         std::to_string(result.height) + " " + std::to_string(result.data.size()) +
+                         "\n";
+                body = std::move(result.data);
+            } catch (const std::exception& e) {
+                header = "error " + std::string(e.what()) + "\n";
+            }
+
+            if (!WriteAll(fd, header.data(), header.size()) ||
+                !WriteAll(fd, body.data(), body.size())) {
+                break;
+            }
+        }
+
+        std::lock_guard lock(mutex_);
+        close(fd);
+        connection->finished = true;
+        connection_finished_.notify_all();
+    }
+
+    // Waits for the render, cancelling it once the client has closed the connection. A client
+    // that only shut down its writing side still gets the reply.
+    static RenderResult WaitForResult(int fd, std::future<RenderResult> result,
+                                      RenderControl* control) {
+        constexpr auto kHangUpCheckInterval = std::chrono::milliseconds(20);
+        while (result.wait_for(kHangUpCheckInterval) != std::future_status::ready) {
+            pollfd poll_fd{.fd = fd, .events = 0, .revents = 0};
+            if (poll(&poll_fd, 1, 0) > 0 && (poll_fd.revents & (POLLHUP | POLLERR))) {
+                control->Cancel();
+            }
+        }
+        return result.get();
+    }
+
+    static bool WriteAll(int fd, const void* data, size_t size) {
+        auto ptr = static_cast<const char*>(data);
+        while (size > 0) {
+            auto written = send(fd, ptr, size, MSG_NOSIGNAL);
+            if (written <= 0) {
+                return false;
+            }
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    RenderService* service_;
+    std::filesystem::path socket_path_;
+    size_t max_clients_;
+    int listen_fd_;
+    std::atomic<bool> stopped_ = false;
+    std::mutex mutex_;
+    std::condition_variable connection_finished_;
+    // A list keeps the addresses of the entries that their threads refer to.
+    std::list<Connection> connections_;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <scene.h>
+
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Keeps recently used scenes resident. Entries are evicted in LRU order once the summed
+// footprint exceeds the memory limit; the most recently used scene is always kept, even if it
+// alone is over the limit. A scene is reloaded if its .obj file changed on disk.
+class SceneCache {
+public:
+    explicit SceneCache(size_t memory_limit) : memory_limit_(memory_limit) {
+    }
+
+    std::shared_ptr<const Scene> Get(const std::filesystem::path& path) {
+        auto key = std::filesystem::canonical(path).string();
+        auto write_time = std::filesystem::last_write_time(path);
+
+        {
+            std::lock_guard lock(mutex_);
+            auto it = index_.find(key);
+            if (it != index_.end() && it->second->write_time == write_time) {
+                entries_.splice(entries_.begin(), entries_, it->second);
+                ++hits_;
+                return it->second->scene;
+            }
+        }
+
+        // Parse outside the lock so that hot scenes stay available while a cold one loads.
+        auto scene = std::make_shared<const Scene>(ReadScene(path));
+        auto bytes = scene->GetMemoryReport().GetResidentBytes();
+
+        std::lock_guard lock(mutex_);
+        ++misses_;
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            resident_bytes_ -= it->second->bytes;
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        entries_.push_front({key, write_time, scene, bytes});
+        index_[key] = entries_.begin();
+        resident_bytes_ += bytes;
+        Evict();
+        return scene;
+    }
+
+    size_t GetResidentBytes() const {
+        std::lock_guard lock(mutex_);
+        return resident_bytes_;
+    }
+
+    size_t GetHits() const {
+        std::lock_guard lock(mutex_);
+        return hits_;
+    }
+
+    size_t GetMisses() const {
+        std::lock_guard lock(mutex_);
+        return misses_;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::filesystem::file_time_type write_time;
+        std::shared_ptr<const Scene> scene;
+        size_t bytes;
+    };
+
+    void Evict() {
+        while (resident_bytes_ > memory_limit_ && entries_.size() > 1) {
+            auto& victim = entries_.back();
+            resident_bytes_ -= victim.bytes;
+            index_.erase(victim.key);
+            entries_.pop_back();
+        }
+    }
+
+    size_t memory_limit_;
+    size_t resident_bytes_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    std::list<Entry> entries_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    mutable std::mutex mutex_;
+};
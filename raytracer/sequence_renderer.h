@@ -0,0 +1,171 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <framebuffer.h>
+#include <pixel_calculator.h>
+#include <screen.h>
+#include <visibility_buffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+struct SequenceOptions {
+    // A reprojected hit is kept if the new camera ray meets the same primitive within this
+    // fraction of the reprojected depth...
+    double depth_tolerance = 0.05;
+    // ...and the cosine between the old and the new normal is at least this.
+    double min_normal_cosine = 0.9;
+    // Every that many frames all pixels are traced from scratch, which picks up geometry that
+    // entered the view without having been visible before. 0 disables the refresh.
+    int refresh_interval = 16;
+};
+
+struct SequenceFrameStats {
+    size_t reprojected = 0;
+    size_t retraced = 0;
+};
+
+// Renders the frames of a camera path through a static scene. Primary hits of the previous
+// frame are splatted into the new camera and validated by intersecting the new camera ray with
+// the same primitive only; pixels that fail, and disoccluded ones, are traced in full. Shading
+// is never reused, so specular, reflected and refracted light always follows the new camera.
+class SequenceRenderer {
+public:
+    SequenceRenderer(const Scene& scene, const RenderOptions& render_options,
+                     const SequenceOptions& options = {})
+        : scene_(scene), render_options_(render_options), options_(options) {
+        if (render_options.depth < 1) {
+            throw std::runtime_error("Sequences need a depth of at least 1");
+        }
+        if (render_options.crop) {
+            throw std::runtime_error("Sequences are rendered without a crop window");
+        }
+    }
+
+    Framebuffer RenderFrame(const CameraOptions& camera_options) {
+        auto screen = Screen(camera_options);
+        const int width = camera_options.screen_width;
+        const int height = camera_options.screen_height;
+
+        bool reproject = !samples_.empty() && width == width_ && height == height_ &&
+                         (options_.refresh_interval == 0 ||
+                          frame_ % options_.refresh_interval != 0);
+        auto splats = reproject ? Splat(screen) : VisibilityBuffer(width, height);
+
+        Framebuffer preprocessed_pixels(width, height);
+        std::vector<Sample> samples(static_cast<size_t>(width) * height);
+        stats_ = {};
+
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                auto ray = screen.GetCameraRay(x, y);
+                auto& sample = samples[static_cast<size_t>(y) * width + x];
+
+                auto hit = Reproject(splats, ray, x, y, &sample.primitive);
+                if (hit) {
+                    ++stats_.reprojected;
+                } else {
+                    hit = Intersect(ray, scene_, &sample.primitive);
+                    ++stats_.retraced;
+                }
+
+                if (!hit) {
+                    sample.primitive = VisibilityBuffer::kNoPrimitive;
+                    preprocessed_pixels.At(x, y) = CalculateMiss(render_options_);
+                    continue;
+                }
+                const auto& [intersection, _, norm] = hit.value();
+                sample.position = intersection.GetPosition();
+                sample.normal = norm;
+                preprocessed_pixels.At(x, y) = CalculateHit(ray, *hit, scene_, render_options_);
+            }
+        }
+
+        samples_ = std::move(samples);
+        width_ = width;
+        height_ = height;
+        ++frame_;
+        return preprocessed_pixels;
+    }
+
+    const SequenceFrameStats& GetLastFrameStats() const {
+        return stats_;
+    }
+
+private:
+    struct Sample {
+        int primitive = VisibilityBuffer::kNoPrimitive;
+        Vector position;
+        Vector normal;
+    };
+
+    // Forward-projects the previous hits onto the 2x2 pixels around their new position and
+    // keeps the nearest per pixel. The buffer stores indices into samples_.
+    VisibilityBuffer Splat(const Screen& screen) const {
+        VisibilityBuffer splats(width_, height_);
+        const auto& look_from = screen.GetCameraOptions().look_from;
+
+        for (size_t i = 0; i < samples_.size(); ++i) {
+            const auto& sample = samples_[i];
+            if (sample.primitive == VisibilityBuffer::kNoPrimitive) {
+                continue;
+            }
+            auto projection = ProjectPoint(screen, sample.position);
+            if (!projection) {
+                continue;
+            }
+            auto [pixel_x, pixel_y] = projection.value();
+            int x0 = static_cast<int>(std::floor(pixel_x));
+            int y0 = static_cast<int>(std::floor(pixel_y));
+            double depth = Length(sample.position - look_from);
+
+            for (int y = std::max(y0, 0); y <= std::min(y0 + 1, height_ - 1); ++y) {
+                for (int x = std::max(x0, 0); x <= std::min(x0 + 1, width_ - 1); ++x) {
+                    splats.Update(x, y, static_cast<int>(i), depth);
+                }
+            }
+        }
+
+        return splats;
+    }
+
+    std::optional<std::tuple<Intersection, const Material*, Vector>> Reproject(
+        const VisibilityBuffer& splats, const Ray& ray, int x, int y, int* primitive) const {
+
+        int index = splats.GetPrimitive(x, y);
+        if (index == VisibilityBuffer::kNoPrimitive) {
+            return std::nullopt;
+        }
+        const auto& sample = samples_[index];
+        auto hit = IntersectPrimitive(ray, scene_, sample.primitive);
+        if (!hit) {
+            return std::nullopt;
+        }
+
+        const auto& [intersection, _, norm] = hit.value();
+        double depth = splats.GetDepth(x, y);
+        if (std::fabs(intersection.GetDistance() - depth) > options_.depth_tolerance * depth ||
+            DotProduct(norm, sample.normal) < options_.min_normal_cosine) {
+            return std::nullopt;
+        }
+
+        *primitive = sample.primitive;
+        return hit;
+    }
+
+    const Scene& scene_;
+    RenderOptions render_options_;
+    SequenceOptions options_;
+
+    std::vector<Sample> samples_;
+    int width_ = 0;
+    int height_ = 0;
+    int frame_ = 0;
+    SequenceFrameStats stats_;
+};
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+#include <pixel_calculator.h>
+#include <render_control.h>
+#include <visibility_buffer.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numbers>
+#include <stdexcept>
+#include <vector>
+
+// Depth of the nearest surface around a point light, stored in single precision on the six faces
+// of a cube around it. Each face is a z-buffer with resolution x resolution texels over a 90
+// degree frustum along one axis, and primitives are scan-converted into it: polygons by their
+// spans per row of texel centers with 1 / depth interpolated across them, spheres by a ray test
+// per texel of their projected bounds. The work is proportional to the texels a primitive covers.
+class CubeShadowMap {
+public:
+    CubeShadowMap(const Scene& scene, const Vector& position, int resolution, double bias,
+                  const RenderControl* control = nullptr)
+        : position_(position), resolution_(resolution), bias_(bias), control_(control) {
+        if (resolution <= 0) {
+            throw std::runtime_error("Shadow map resolution must be positive");
+        }
+        for (auto& depths : faces_) {
+            depths.assign(static_cast<size_t>(resolution) * resolution,
+                          std::numeric_limits<float>::infinity());
+        }
+
+        for (const auto& obj : scene.GetObjects()) {
+            const auto& triangle = obj.polygon;
+            std::array<Vector, 3> offsets = {triangle[0] - position, triangle[1] - position,
+                                             triangle[2] - position};
+            RasterizePolygon(offsets);
+        }
+        const auto& polygons = scene.GetPolygonPool();
+        std::vector<Vector> offsets;
+        for (const auto& obj : polygons.objects) {
+            auto polygon = polygons.GetPolygon(obj);
+            offsets.clear();
+            for (size_t k = 0; k < polygon.Size(); ++k) {
+                offsets.push_back(polygon[k] - position);
+            }
+            RasterizePolygon(offsets);
+        }
+        for (const auto& obj : scene.GetSphereObjects()) {
+            RasterizeSphere(obj.sphere);
+        }
+    }
+
+    // Whether something lies between the light and the point, up to the bias, which is a
+    // fraction of the distance to the light.
+    bool IsShadowed(const Vector& point) const {
+        auto offset = point - position_;
+        size_t axis = 0;
+        for (size_t k = 1; k < 3; ++k) {
+            if (std::fabs(offset[k]) > std::fabs(offset[axis])) {
+                axis = k;
+            }
+        }
+        auto face = FaceIndex(axis, offset[axis] < 0 ? -1. : 1.);
+        auto [u, v, depth] = ToFace(offset, face);
+        if (depth < kEps) {
+            return false;
+        }
+
+        const int last = resolution_ - 1;
+        int x = std::clamp(static_cast<int>(std::lround(ToTexel(u / depth))), 0, last);
+        int y = std::clamp(static_cast<int>(std::lround(ToTexel(v / depth))), 0, last);
+        return faces_[face][Index(x, y)] < depth * (1 - bias_);
+    }
+
+private:
+    // A point relative to the light in the space of a face: its coordinates along the other two
+    // axes and its depth along the face's own.
+    struct FaceVertex {
+        double u, v, depth;
+    };
+
+    static size_t FaceIndex(size_t axis, double sign) {
+        return 2 * axis + (sign < 0);
+    }
+
+    static FaceVertex ToFace(const Vector& offset, size_t face) {
+        auto axis = face / 2;
+        double sign = face % 2 ? -1. : 1.;
+        return {offset[(axis + 1) % 3], offset[(axis + 2) % 3], sign * offset[axis]};
+    }
+
+    // Continuous texel coordinate of a projected coordinate in [-1, 1], with texel centers at
+    // integers.
+    double ToTexel(double projected) const {
+        return (projected + 1) * resolution_ / 2 - 0.5;
+    }
+
+    size_t Index(int x, int y) const {
+        return static_cast<size_t>(y) * resolution_ + x;
+    }
+
+    void CheckControl() {
+        if (control_ && rows_++ % RenderControl::kPixelsPerCheck == 0) {
+            control_->Check();
+        }
+    }
+
+    template <class Offsets>
+    void RasterizePolygon(const Offsets& offsets) {
+        for (size_t face = 0; face < faces_.size(); ++face) {
+            // Clips the polygon to the part in front of the light, then projects it.
+            clipped_.clear();
+            for (size_t i = 0; i < offsets.size(); ++i) {
+                auto a = ToFace(offsets[i], face);
+                auto b = ToFace(offsets[(i + 1) % offsets.size()], face);
+                if (a.depth >= kEps) {
+                    clipped_.push_back(a);
+                }
+                if ((a.depth >= kEps) != (b.depth >= kEps)) {
+                    double t = (kEps - a.depth) / (b.depth - a.depth);
+                    clipped_.push_back(
+                        {a.u + t * (b.u - a.u), a.v + t * (b.v - a.v), kEps});
+                }
+            }
+            if (clipped_.size() < 3) {
+                continue;
+            }
+            for (auto& vertex : clipped_) {
+                vertex = {ToTexel(vertex.u / vertex.depth), ToTexel(vertex.v / vertex.depth),
+                          1 / vertex.depth};
+            }
+            FillPolygon(faces_[face]);
+        }
+    }
+
+    // Scan-converts the projected polygon in clipped_, whose depth fields hold 1 / depth.
+    void FillPolygon(std::vector<float>& depths) {
+        const auto& vertices = clipped_;
+        double y_min = vertices[0].v, y_max = vertices[0].v;
+        for (const auto& vertex : vertices) {
+            y_min = std::min(y_min, vertex.v);
+            y_max = std::max(y_max, vertex.v);
+        }
+        int y_begin = std::max(static_cast<int>(std::ceil(y_min)), 0);
+        int y_end = std::min(static_cast<int>(std::floor(y_max)), resolution_ - 1);
+        if (y_begin > y_end) {
+            return;
+        }
+
+        // 1 / depth is affine in texel coordinates; the plane comes from the largest triangle of
+        // a fan, and polygons seen edge-on are skipped.
+        const auto& p0 = vertices[0];
+        double area = 0, dx = 0, dy = 0;
+        for (size_t i = 1; i + 1 < vertices.size(); ++i) {
+            const auto& p1 = vertices[i];
+            const auto& p2 = vertices[i + 1];
+            double cross = (p1.u - p0.u) * (p2.v - p0.v) - (p2.u - p0.u) * (p1.v - p0.v);
+            if (std::fabs(cross) > std::fabs(area)) {
+                area = cross;
+                dx = ((p1.depth - p0.depth) * (p2.v - p0.v) -
+                      (p2.depth - p0.depth) * (p1.v - p0.v)) /
+                     cross;
+                dy = ((p2.depth - p0.depth) * (p1.u - p0.u) -
+                      (p1.depth - p0.depth) * (p2.u - p0.u)) /
+                     cross;
+            }
+        }
+        if (std::fabs(area) < 1e-12) {
+            return;
+        }
+
+        // Depth changes by about depth^2 * slope across a texel, so that is added to what is
+        // stored: otherwise a surface seen at a grazing angle shadows itself wherever the texel
+        // center lies nearer to the light than the point looked up.
+        double slope = std::fabs(dx) + std::fabs(dy);
+
+        auto& counters = GetTraceCounters();
+        for (int y = y_begin; y <= y_end; ++y) {
+            CheckControl();
+            double x_min = std::numeric_limits<double>::infinity(), x_max = -x_min;
+            for (size_t i = 0; i < vertices.size(); ++i) {
+                const auto& a = vertices[i];
+                const auto& b = vertices[(i + 1) % vertices.size()];
+                if (std::min(a.v, b.v) > y || std::max(a.v, b.v) < y) {
+                    continue;
+                }
+                if (a.v == b.v) {
+                    x_min = std::min({x_min, a.u, b.u});
+                    x_max = std::max({x_max, a.u, b.u});
+                } else {
+                    double x = a.u + (y - a.v) * (b.u - a.u) / (b.v - a.v);
+                    x_min = std::min(x_min, x);
+                    x_max = std::max(x_max, x);
+                }
+            }
+            int x_begin = std::max(static_cast<int>(std::ceil(x_min)), 0);
+            int x_end = std::min(static_cast<int>(std::floor(x_max)), resolution_ - 1);
+            for (int x = x_begin; x <= x_end; ++x) {
+                double inv_depth = p0.depth + dx * (x - p0.u) + dy * (y - p0.v);
+                if (inv_depth > 0) {
+                    double depth = 1 / inv_depth;
+                    auto& stored = depths[Index(x, y)];
+                    stored = std::min(stored, static_cast<float>(depth + depth * depth * slope));
+                }
+            }
+            counters.primitive_tests += std::max(x_end - x_begin + 1, 0);
+        }
+    }
+
+    void RasterizeSphere(const Sphere& sphere) {
+        auto& counters = GetTraceCounters();
+        auto corners = GetBoxCorners(sphere);
+        for (size_t face = 0; face < faces_.size(); ++face) {
+            // Texel bounds of the projected bounding box, or the whole face if the box reaches
+            // behind the light.
+            int x_begin = 0, y_begin = 0, x_end = resolution_ - 1, y_end = resolution_ - 1;
+            bool behind = true, crosses = false;
+            double x_min = std::numeric_limits<double>::infinity(), x_max = -x_min;
+            double y_min = x_min, y_max = -x_min;
+            for (const auto& corner : corners) {
+                auto vertex = ToFace(corner - position_, face);
+                behind = behind && vertex.depth < kEps;
+                crosses = crosses || vertex.depth < kEps;
+                if (vertex.depth >= kEps) {
+                    x_min = std::min(x_min, ToTexel(vertex.u / vertex.depth));
+                    x_max = std::max(x_max, ToTexel(vertex.u / vertex.depth));
+                    y_min = std::min(y_min, ToTexel(vertex.v / vertex.depth));
+                    y_max = std::max(y_max, ToTexel(vertex.v / vertex.depth));
+                }
+            }
+            if (behind) {
+                continue;
+            }
+            if (!crosses) {
+                x_begin = std::max(static_cast<int>(std::floor(x_min)), 0);
+                y_begin = std::max(static_cast<int>(std::floor(y_min)), 0);
+                x_end = std::min(static_cast<int>(std::ceil(x_max)), resolution_ - 1);
+                y_end = std::min(static_cast<int>(std::ceil(y_max)), resolution_ - 1);
+            }
+
+            auto axis = face / 2;
+            double sign = face % 2 ? -1. : 1.;
+            for (int y = y_begin; y <= y_end; ++y) {
+                CheckControl();
+                for (int x = x_begin; x <= x_end; ++x) {
+                    Vector direction;
+                    direction[axis] = sign;
+                    direction[(axis + 1) % 3] = (2. * x + 1) / resolution_ - 1;
+                    direction[(axis + 2) % 3] = (2. * y + 1) / resolution_ - 1;
+                    auto length = Length(direction);
+                    auto intersection = GetIntersection(Ray(position_, direction), sphere);
+                    if (intersection) {
+                        auto& depth = faces_[face][Index(x, y)];
+                        depth = std::min(
+                            depth, static_cast<float>(intersection->GetDistance() / length));
+                    }
+                }
+                counters.primitive_tests += std::max(x_end - x_begin + 1, 0);
+            }
+        }
+    }
+
+    Vector position_;
+    int resolution_;
+    double bias_;
+    const RenderControl* control_;
+    int rows_ = 0;
+    std::vector<FaceVertex> clipped_;
+    std::array<std::vector<float>, 6> faces_;
+};
+
+// Texels along a side of a cube face: the given resolution, or by default as many as there are
+// pixels in 90 degrees of the camera's vertical field of view, so that a texel covers about the
+// angle of a pixel. Each light then takes 6 * 4 * resolution^2 bytes.
+int GetShadowMapResolution(const ShadowMapOptions& options, const CameraOptions& camera_options) {
+    if (options.resolution) {
+        return options.resolution.value();
+    }
+    auto resolution = camera_options.screen_height * (std::numbers::pi / 2) / camera_options.fov;
+    return std::max(static_cast<int>(std::ceil(resolution)), 1);
+}
+
+std::vector<CubeShadowMap> BuildShadowMaps(const Scene& scene, const ShadowMapOptions& options,
+                                           const CameraOptions& camera_options,
+                                           const RenderControl* control = nullptr) {
+    auto resolution = GetShadowMapResolution(options, camera_options);
+    std::vector<CubeShadowMap> maps;
+    maps.reserve(scene.GetLights().size());
+    for (const auto& light : scene.GetLights()) {
+        maps.emplace_back(scene, light.position, resolution, options.bias, control);
+    }
+    return maps;
+}
+
+// Scene whose shadow tests look up the shadow maps of its lights instead of tracing rays. SceneT
+// is a Scene or a LodSceneView of one.
+template <class SceneT>
+class ShadowMappedScene {
+public:
+    ShadowMappedScene(const SceneT& scene, const std::vector<CubeShadowMap>& maps)
+        : scene_(scene), maps_(maps) {
+    }
+
+    const SceneT& GetScene() const {
+        return scene_;
+    }
+
+    const auto& GetLights() const {
+        return scene_.GetLights();
+    }
+
+    const CubeShadowMap& GetShadowMap(const Light& light) const {
+        return maps_[&light - GetLights().data()];
+    }
+
+private:
+    const SceneT& scene_;
+    const std::vector<CubeShadowMap>& maps_;
+};
+
+template <class SceneT>
+std::optional<std::tuple<Intersection, const Material*, Vector>> Intersect(
+    const Ray& ray, const ShadowMappedScene<SceneT>& scene) {
+    return Intersect(ray, scene.GetScene());
+}
+
+template <class SceneT>
+bool IsLightShadowed(const Vector& pos, const Light& light,
+                     const ShadowMappedScene<SceneT>& scene) {
+    return scene.GetShadowMap(light).IsShadowed(pos);
+}
@@ -2,6 +2,12 @@
 #include <options/render_options.h>
 #include <tests/commons.h>
 #include <raytracer.h>
+#include <render_service.h>
+#include <gbuffer.h>
+#include <sequence_renderer.h>
+#include <async_image_writer.h>
+#include <async_render.h>
+#include <trace_recorder.h>
 #include <util.h>
 #include <image.h>
 
@@ -9,6 +15,12 @@
 #include <string_view>
 #include <optional>
 #include <numbers>
+#include <random>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
 
 #include <catch2/catch_test_macros.hpp>
 
@@ -87,3 +99,976 @@ TEST_CASE("Deer", "[no_asan]") {
                               .look_to = {0., 100., 0.}};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, {1});
 }
+
+TEST_CASE("Render service") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    RenderService service(2, 64 << 20);
+
+    RenderJob job{.scene_path = kTestsDir / "triangle/scene.obj",
+                  .camera_options = {.screen_width = 640,
+                                     .screen_height = 480,
+                                     .look_from = {0., 2., 0.},
+                                     .look_to = {0., 0., 0.}},
+                  .render_options = {1},
+                  .format = OutputFormat::kRaw};
+    auto first = service.Submit(job);
+    auto second = service.Submit(job);
+
+    for (auto* future : {&first, &second}) {
+        auto result = future->get();
+        REQUIRE(result.data.size() == 640 * 480 * 3);
+
+        Image image(result.width, result.height);
+        for (int y = 0; y < result.height; ++y) {
+            for (int x = 0; x < result.width; ++x) {
+                const auto* rgb = &result.data[(y * result.width + x) * 3];
+                image.SetPixel({rgb[0], rgb[1], rgb[2]}, y, x);
+            }
+        }
+        Compare(image, Image{kTestsDir / "triangle/scene.png"});
+    }
+    CHECK(service.GetCache().GetMisses() + service.GetCache().GetHits() == 2);
+    CHECK(service.GetCache().GetResidentBytes() > 0);
+}
+
+// Connects to the server and sends a single request line.
+int SendRequest(const std::filesystem::path& socket_path, const std::string& request) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socket_path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+
+    REQUIRE(send(fd, request.data(), request.size(), MSG_NOSIGNAL) ==
+            static_cast<ssize_t>(request.size()));
+    return fd;
+}
+
+// Requests a tiny render of the triangle scene.
+int SendRenderRequest(const std::filesystem::path& socket_path) {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    return SendRequest(socket_path, "render 0 raw 8 8 1 0 2 0 0 0 0 1 full " +
+                                        (kTestsDir / "triangle/scene.obj").string() + "\n");
+}
+
+std::string ReadReply(int fd) {
+    std::string reply;
+    char chunk[256];
+    while (reply.size() < 11 + 8 * 8 * 3) {
+        auto size = read(fd, chunk, sizeof(chunk));
+        if (size <= 0) {
+            break;
+        }
+        reply.append(chunk, size);
+    }
+    return reply.substr(0, reply.find('\n'));
+}
+
+TEST_CASE("Render server", "[no_asan]") {
+    auto socket_path = std::filesystem::temp_directory_path() / "raytracer_test.sock";
+    RenderService service(1, 64 << 20);
+    RenderServer server(&service, socket_path, 1);
+    std::thread serve([&server] { server.Serve(); });
+
+    for (int i = 0; i < 20; ++i) {
+        int fd = SendRenderRequest(socket_path);
+        CHECK(ReadReply(fd) == "ok 8 8 192");
+        close(fd);
+    }
+    // Threads of closed connections are joined before accepting the next one.
+    CHECK(server.GetNumConnections() <= 1);
+
+    int first = SendRenderRequest(socket_path);
+    CHECK(ReadReply(first) == "ok 8 8 192");
+    int second = SendRenderRequest(socket_path);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(server.GetNumConnections() == 1);
+    close(first);
+    CHECK(ReadReply(second) == "ok 8 8 192");
+    close(second);
+
+    // A render that takes far longer than the test is cancelled when its client goes away.
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto deer_path = (kTestsDir / "deer/CERF_Free.obj").string();
+    auto deer_request = "render 0 raw 2000 2000 1 100 200 150 0 100 0 4 full ";
+    int abandoned = SendRequest(socket_path, deer_request + deer_path + "\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    close(abandoned);
+    auto start = std::chrono::steady_clock::now();
+    while (server.GetNumConnections() > 0) {
+        REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(2));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    // A client that shuts down only its writing side still gets the reply.
+    int late = SendRequest(socket_path, deer_request + ("deadline=50 " + deer_path) + "\n");
+    shutdown(late, SHUT_WR);
+    CHECK(ReadReply(late) == "error Render deadline exceeded");
+    close(late);
+
+    server.Stop();
+    serve.join();
+}
+
+TEST_CASE("Render request deadline") {
+    auto job = ParseRenderJob("render 1 png 8 8 1 0 2 0 0 0 0 1 full deadline=250 a b.obj");
+    CHECK(job.time_limit == std::chrono::milliseconds(250));
+    CHECK(job.scene_path == "a b.obj");
+    CHECK_FALSE(ParseRenderJob("render 1 png 8 8 1 0 2 0 0 0 0 1 full a.obj").time_limit);
+    for (const auto* deadline : {"deadline=", "deadline=-1", "deadline=1x", "deadline=5"}) {
+        INFO(deadline);
+        CHECK_THROWS(ParseRenderJob("render 1 png 8 8 1 0 2 0 0 0 0 1 full " +
+                                    std::string(deadline)));
+    }
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    RenderService service(1, 64 << 20);
+    RenderJob expired{.scene_path = kTestsDir / "triangle/scene.obj",
+                      .camera_options = {.screen_width = 8, .screen_height = 8},
+                      .render_options = {1},
+                      .time_limit = std::chrono::milliseconds(0)};
+    CHECK_THROWS_AS(service.Submit(expired).get(), RenderCancelled);
+
+    auto cancelled = expired;
+    cancelled.time_limit = std::nullopt;
+    cancelled.control = std::make_shared<RenderControl>();
+    cancelled.control->Cancel();
+    CHECK_THROWS_AS(service.Submit(cancelled).get(), RenderCancelled);
+}
+
+TEST_CASE("Gamma estimate") {
+    int unsure = 0;
+    int total = 0;
+    auto check = [&](float color) {
+        INFO(color);
+        auto level = GetGammaColorEstimate(color);
+        ++total;
+        if (level < 0) {
+            ++unsure;
+        } else {
+            REQUIRE(level == GetGammaColor(color));
+        }
+    };
+
+    // Around the smallest input of every level, where an off-by-one would show up first.
+    for (int level = 1; level < 256; ++level) {
+        auto threshold = static_cast<float>(std::pow(level / 255., 2.2));
+        auto color = threshold;
+        for (int i = 0; i < 64; ++i) {
+            color = std::nextafter(color, 0.f);
+        }
+        for (int i = 0; i < 128; ++i) {
+            check(color);
+            color = std::nextafter(color, 2.f);
+        }
+    }
+    for (float color : {0.f, 1e-30f, std::nextafter(1.f, 0.f), 1.f, 1.5f, -1.f}) {
+        check(color);
+    }
+    REQUIRE(GetGammaColorEstimate(std::numeric_limits<float>::quiet_NaN()) == -1);
+
+    unsure = 0;
+    total = 0;
+    std::mt19937_64 random(3);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+    std::uniform_real_distribution<float> exponent(-30.f, 0.f);
+    for (int i = 0; i < 1000000; ++i) {
+        check(uniform(random));
+        check(std::exp2(exponent(random)));
+    }
+    CHECK(unsure < total / 500);
+}
+
+TEST_CASE("Tone mapping and gamma rows") {
+    constexpr double kMax = 3.;
+    constexpr double kInvMaxSquared = 1 / (kMax * kMax);
+    std::mt19937_64 random(4);
+    std::exponential_distribution<double> exponential(2.);
+    std::vector<double> data;
+    for (int i = 0; i < 100000; ++i) {
+        data.push_back(exponential(random));
+    }
+    // Channels that tone map close to the smallest input of every level.
+    for (int level = 1; level < 256; ++level) {
+        auto target = std::pow(level / 255., 2.2);
+        auto color = target / (1 - target);
+        for (int i = 0; i < 16; ++i) {
+            color = std::nextafter(color, 0.);
+        }
+        for (int i = 0; i < 32; ++i) {
+            data.push_back(color);
+            color = std::nextafter(color, 1e300);
+        }
+    }
+    for (double color : {0., 1e-300, kMax, std::nextafter(kMax, 0.), kMax * 2, 1e40, 1e300}) {
+        data.push_back(color);
+    }
+
+    std::vector<int> expected;
+    for (auto color : data) {
+        expected.push_back(GetGammaColor(ToneMap(color, kInvMaxSquared)));
+    }
+    for (auto isa : {Isa::kGeneric, Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+        if (!IsIsaSupported(isa)) {
+            continue;
+        }
+        INFO(GetIsaName(isa));
+        SetIsaOverride(isa);
+        // Odd sizes leave a scalar remainder after the vectorized loop.
+        for (size_t size : {data.size(), data.size() - 5}) {
+            std::vector<int> levels(size);
+            ToneMapGammaRow(data.data(), levels.data(), size, kInvMaxSquared);
+            for (size_t i = 0; i < size; ++i) {
+                INFO(data[i]);
+                REQUIRE(levels[i] == expected[i]);
+            }
+        }
+    }
+    SetIsaOverride(std::nullopt);
+}
+
+TEST_CASE("Parallel blocks") {
+    for (size_t size : {0, 1, 63, 64, 100, 1001}) {
+        for (size_t num_blocks : {1, 3, 7, 16}) {
+            std::vector<int> visits(size);
+            std::vector<std::pair<size_t, size_t>> ranges(num_blocks, {0, 0});
+            auto used = ParallelBlocks(
+                size, 64,
+                [&](size_t block, size_t begin, size_t end) {
+                    ranges[block] = {begin, end};
+                    for (auto i = begin; i < end; ++i) {
+                        ++visits[i];
+                    }
+                },
+                num_blocks);
+
+            CHECK(used == std::max<size_t>(1, std::min(num_blocks, size / 64)));
+            CHECK(std::ranges::all_of(visits, [](int count) { return count == 1; }));
+            for (size_t block = 0; block < used; ++block) {
+                CHECK(ranges[block].first == (block == 0 ? 0 : ranges[block - 1].second));
+                CHECK(ranges[block].second - ranges[block].first >= std::min<size_t>(size, 64));
+            }
+            CHECK(ranges[used - 1].second == size);
+        }
+    }
+
+    // Rows that don't split evenly into blocks, and rows that don't split into four channels.
+    Framebuffer pixels(7, 3 * kMinRowsPerThread + 5);
+    for (int y = 0; y < pixels.Height(); ++y) {
+        for (int x = 0; x < pixels.Width(); ++x) {
+            pixels.At(x, y) = {.1, .2, .3};
+        }
+    }
+    CHECK(GetMaxChannel(pixels) == .3);
+    pixels.At(6, pixels.Height() - 1)[2] = 4.;
+    CHECK(GetMaxChannel(pixels) == 4.);
+    pixels.At(0, 0)[0] = 5.;
+    CHECK(GetMaxChannel(pixels) == 5.);
+}
+
+TEST_CASE("Rasterized primary visibility") {
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    CheckImage("box/cube.obj", "box/cube.png", camera_opts, {4, RenderMode::kFull, true});
+}
+
+TEST_CASE("Out of core scene", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto cluster_path = std::filesystem::temp_directory_path() / "raytracer_classic_box.clusters";
+    WriteClusterFile(kTestsDir / "classic_box/CornellBox.obj", cluster_path, 4);
+
+    // A budget of a few clusters forces them to be paged in and out during the render.
+    OutOfCoreScene scene(cluster_path, 4 * 4 * sizeof(Object));
+    CameraOptions camera_opts{.screen_width = 500,
+                              .screen_height = 500,
+                              .look_from = {-.5, 1.5, .98},
+                              .look_to = {0., 1., 0.}};
+    Image image(camera_opts.screen_width, camera_opts.screen_height);
+    RenderImage(&image, scene, camera_opts, {4});
+    Compare(image, Image{kTestsDir / "classic_box/first.png"});
+
+    const auto& nodes = scene.GetClusterNodes();
+    CHECK(nodes.size() == 2 * scene.GetClusters().size() - 1);
+    CHECK(std::ranges::count_if(nodes, [](const auto& node) { return node.is_leaf; }) ==
+          static_cast<int>(scene.GetClusters().size()));
+
+    auto stats = scene.GetStats();
+    CHECK(stats.page_ins > scene.GetClusters().size());
+    CHECK(stats.evictions > 0);
+    CHECK(stats.resident_bytes <= stats.peak_resident_bytes);
+
+    // With a budget far below the scene, the file is parsed in many chunks and the triangles
+    // are spread over many spill files, which must not change the result.
+    auto small_budget_path = cluster_path;
+    small_budget_path += ".small_budget";
+    WriteClusterFile(kTestsDir / "classic_box/CornellBox.obj", small_budget_path, 4, 1);
+    auto read_file = [](const std::filesystem::path& path) {
+        std::ifstream is{path, std::ios::binary};
+        return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    };
+    CHECK(read_file(small_budget_path) == read_file(cluster_path));
+    for (const auto& path : {cluster_path, small_budget_path}) {
+        auto spill_dir = path;
+        spill_dir += ".spill";
+        CHECK_FALSE(std::filesystem::exists(spill_dir));
+    }
+
+    std::filesystem::remove(cluster_path);
+    std::filesystem::remove(small_budget_path);
+}
+
+TEST_CASE("Levels of detail", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto obj_path = kTestsDir / "deer/CERF_Free.obj";
+    auto full = ReadScene(obj_path);
+    auto simplified = ReadScene(
+        obj_path, {.lods = LodOptions{.triangles_per_pixel = 0.25, .max_error_pixels = 1}});
+
+    const auto& meshes = simplified.GetLodMeshes();
+    REQUIRE(meshes.size() == 1);
+    REQUIRE(!meshes[0].levels.empty());
+    CHECK(meshes[0].levels.back().objects.size() < full.GetObjects().size() / 4);
+
+    CameraOptions camera_opts{.screen_width = 500,
+                              .screen_height = 500,
+                              .look_from = {1000., 2000., 1500.},
+                              .look_to = {0., 100., 0.}};
+    auto& counters = GetTraceCounters();
+    auto tests = counters.primitive_tests;
+    Image expected(camera_opts.screen_width, camera_opts.screen_height);
+    RenderImage(&expected, full, camera_opts, {1});
+    auto full_tests = counters.primitive_tests - tests;
+
+    tests = counters.primitive_tests;
+    Image image(camera_opts.screen_width, camera_opts.screen_height);
+    RenderImage(&image, simplified, camera_opts, {1});
+    auto lod_tests = counters.primitive_tests - tests;
+
+    Compare(image, expected);
+    CHECK(lod_tests < full_tests / 10);
+}
+
+TEST_CASE("Spatially sorted scene", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto obj_path = kTestsDir / "deer/CERF_Free.obj";
+    auto file_order = ReadScene(obj_path);
+    auto sorted = ReadScene(obj_path, {.spatial_sort = true});
+    REQUIRE(sorted.GetObjects().size() == file_order.GetObjects().size());
+
+    // Every triangle keeps its own vertex normals: the sets of (material, vertices, normals)
+    // are the same in both orders.
+    auto get_keys = [](const Scene& scene) {
+        std::vector<std::pair<std::string, std::vector<double>>> keys;
+        for (const auto& object : scene.GetObjects()) {
+            REQUIRE(object.NormalExists());
+            auto& key = keys.emplace_back(object.material->name, std::vector<double>{});
+            for (size_t k = 0; k < 3; ++k) {
+                for (size_t axis = 0; axis < 3; ++axis) {
+                    key.second.push_back(object.polygon[k][axis]);
+                    key.second.push_back((*object.GetNormal(k))[axis]);
+                }
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    };
+    CHECK(get_keys(sorted) == get_keys(file_order));
+    CHECK(!std::ranges::equal(sorted.GetObjects(), file_order.GetObjects(),
+                              [](const Object& lhs, const Object& rhs) {
+                                  return lhs.polygon[0] == rhs.polygon[0];
+                              }));
+
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 160,
+                              .look_from = {100., 200., 150.},
+                              .look_to = {0., 100., 0.}};
+    auto expected = Raytrace(file_order, camera_opts, {1});
+    auto pixels = Raytrace(sorted, camera_opts, {1});
+    for (int y = 0; y < pixels.Height(); ++y) {
+        for (int x = 0; x < pixels.Width(); ++x) {
+            REQUIRE(pixels.At(x, y) == expected.At(x, y));
+        }
+    }
+}
+
+TEST_CASE("Cost heatmap") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "triangle/scene.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .look_from = {0., 2., 0.},
+                              .look_to = {0., 0., 0.}};
+
+    // A miss traces only the camera ray, a hit adds a single shadow ray.
+    auto rays = Raytrace(scene, camera_opts, {1, RenderMode::kCost});
+    size_t hits = 0;
+    for (int y = 0; y < rays.Height(); ++y) {
+        for (int x = 0; x < rays.Width(); ++x) {
+            auto value = rays.At(x, y)[0];
+            REQUIRE((value == 1 || value == 2));
+            hits += value == 2;
+        }
+    }
+    CHECK(hits > 0);
+    CHECK(hits < static_cast<size_t>(rays.Width() * rays.Height()));
+
+    RenderOptions tests_options{1, RenderMode::kCost, false, CostMetric::kPrimitiveTests};
+    auto tests = Raytrace(scene, camera_opts, tests_options);
+    CHECK(tests.At(0, 0)[0] == 1);
+
+    Image image(camera_opts.screen_width, camera_opts.screen_height);
+    RenderImage(&image, scene, camera_opts, {1, RenderMode::kCost});
+    // Misses cost half of the most expensive pixel, which is the middle of the ramp.
+    auto miss = image.GetPixel(0, 0);
+    CHECK((miss.r == 0 && miss.g == 255 && miss.b == 0));
+}
+
+TEST_CASE("Crop window") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .look_from = {0., 0.7, 1.75},
+                              .look_to = {0., 0.7, 0.}};
+    CropWindow crop{20, 10, 30, 17};
+
+    for (auto rasterize : {false, true}) {
+        auto full = Raytrace(scene, camera_opts, {4, RenderMode::kFull, rasterize});
+        auto cropped = Raytrace(scene, camera_opts, {4, RenderMode::kFull, rasterize, {}, crop});
+        REQUIRE(cropped.Width() == crop.width);
+        REQUIRE(cropped.Height() == crop.height);
+        for (int y = 0; y < crop.height; ++y) {
+            for (int x = 0; x < crop.width; ++x) {
+                REQUIRE(cropped.At(x, y) == full.At(crop.x + x, crop.y + y));
+            }
+        }
+    }
+
+    RenderOptions render_opts{4, RenderMode::kNormal, false, {}, crop};
+    Image region(crop.width, crop.height);
+    RenderImage(&region, scene, camera_opts, render_opts);
+    Image patched(camera_opts.screen_width, camera_opts.screen_height);
+    for (int y = 0; y < patched.Height(); ++y) {
+        for (int x = 0; x < patched.Width(); ++x) {
+            patched.SetPixel({1, 2, 3}, y, x);
+        }
+    }
+    RenderImage(&patched, scene, camera_opts, render_opts);
+    for (int y = 0; y < patched.Height(); ++y) {
+        for (int x = 0; x < patched.Width(); ++x) {
+            bool inside = x >= crop.x && x < crop.x + crop.width && y >= crop.y &&
+                          y < crop.y + crop.height;
+            auto expected = inside ? region.GetPixel(y - crop.y, x - crop.x) : RGB{1, 2, 3};
+            auto pixel = patched.GetPixel(y, x);
+            REQUIRE(std::tie(pixel.r, pixel.g, pixel.b) ==
+                    std::tie(expected.r, expected.g, expected.b));
+        }
+    }
+
+    CHECK_THROWS(Raytrace(scene, camera_opts, {4, RenderMode::kFull, false, {}, {{60, 0, 8, 8}}}));
+}
+
+TEST_CASE("Tiled render") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .look_from = {0., 0.7, 1.75},
+                              .look_to = {0., 0.7, 0.}};
+    std::vector<CropWindow> tiles;
+    for (int y = 0; y < camera_opts.screen_height; y += 20) {
+        for (int x = 0; x < camera_opts.screen_width; x += 24) {
+            tiles.push_back({x, y, std::min(24, camera_opts.screen_width - x),
+                             std::min(20, camera_opts.screen_height - y)});
+        }
+    }
+
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        RenderOptions render_opts{4, mode};
+        Image expected(camera_opts.screen_width, camera_opts.screen_height);
+        RenderImage(&expected, scene, camera_opts, render_opts);
+
+        // Each job reports the normalization of its tile, and the frame uses the largest one.
+        double normalization = 0;
+        for (const auto& tile : tiles) {
+            render_opts.crop = tile;
+            auto pixels = Raytrace(scene, camera_opts, render_opts);
+            normalization = std::max(normalization, GetNormalization(pixels, render_opts));
+        }
+
+        render_opts.normalization = normalization;
+        Image patched(camera_opts.screen_width, camera_opts.screen_height);
+        for (const auto& tile : tiles) {
+            render_opts.crop = tile;
+            RenderImage(&patched, scene, camera_opts, render_opts);
+        }
+        for (int y = 0; y < patched.Height(); ++y) {
+            for (int x = 0; x < patched.Width(); ++x) {
+                auto pixel = patched.GetPixel(y, x);
+                auto expected_pixel = expected.GetPixel(y, x);
+                REQUIRE(std::tie(pixel.r, pixel.g, pixel.b) ==
+                        std::tie(expected_pixel.r, expected_pixel.g, expected_pixel.b));
+            }
+        }
+    }
+}
+
+TEST_CASE("G-buffer relighting") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+
+    auto check_relight = [&](const GBuffer& gbuffer) {
+        auto expected = Raytrace(scene, camera_opts, render_opts);
+        auto relit = Relight(gbuffer, scene, render_opts);
+        for (int y = 0; y < expected.Height(); ++y) {
+            for (int x = 0; x < expected.Width(); ++x) {
+                REQUIRE(relit.At(x, y) == expected.At(x, y));
+            }
+        }
+    };
+
+    auto gbuffer = BuildGBuffer(scene, camera_opts, render_opts);
+    check_relight(gbuffer);
+
+    scene.GetLights()[0].intensity = {0.2, 0.4, 0.8};
+    scene.GetMaterials().at("floor").diffuse_color = {0.9, 0.1, 0.1};
+    scene.GetMaterials().at("rightSphere").specular_exponent = 10;
+    check_relight(gbuffer);
+
+    scene.GetLights()[1].position = {0.3, 1., 0.5};
+    check_relight(gbuffer);
+}
+
+TEST_CASE("Temporal reprojection") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    RenderOptions render_opts{4};
+    SequenceRenderer renderer(scene, render_opts);
+
+    for (int frame = 0; frame < 4; ++frame) {
+        CameraOptions camera_opts{.screen_width = 160,
+                                  .screen_height = 120,
+                                  .fov = std::numbers::pi / 3,
+                                  .look_from = {0.02 * frame, .7, 1.75 - 0.03 * frame},
+                                  .look_to = {0., .7, 0.}};
+
+        Image image(camera_opts.screen_width, camera_opts.screen_height);
+        PostProcess(renderer.RenderFrame(camera_opts), &image);
+        Image expected(camera_opts.screen_width, camera_opts.screen_height);
+        RenderImage(&expected, scene, camera_opts, render_opts);
+        Compare(image, expected);
+
+        const auto& stats = renderer.GetLastFrameStats();
+        CHECK(stats.reprojected + stats.retraced == 160 * 120);
+        if (frame == 0) {
+            CHECK(stats.reprojected == 0);
+        } else {
+            CHECK(stats.reprojected > stats.retraced);
+        }
+    }
+}
+
+TEST_CASE("Camera ray generator") {
+    CameraOptions camera_opts{.screen_width = 40,
+                              .screen_height = 30,
+                              .fov = 1.2,
+                              .look_from = {1., 2., 3.},
+                              .look_to = {-1., 0.5, 0.}};
+    Screen screen(camera_opts);
+    const auto& generator = screen.GetRayGenerator();
+
+    double scale = std::tan(camera_opts.fov / 2);
+    double aspect = 40. / 30.;
+    for (int y = 0; y < 30; ++y) {
+        for (int x = 0; x < 40; ++x) {
+            Vector t = {(2 * (x + 0.5) / 40 - 1) * aspect * scale,
+                        -(2 * (y + 0.5) / 30 - 1) * scale, -1};
+            t.Normalize();
+            auto expected = t[0] * screen.GetRight() + t[1] * screen.GetUp() +
+                            t[2] * screen.GetForward();
+            auto direction = screen.GetPointRay(x, y);
+            REQUIRE(Length(direction - expected) < 1e-12);
+        }
+    }
+
+    RayPacket packet;
+    generator.GenerateTile({5, 7, 13, 11}, &packet);
+    REQUIRE(packet.Size() == 13 * 11);
+    for (size_t i = 0; i < packet.Size(); ++i) {
+        auto ray = packet.GetRay(i);
+        REQUIRE(ray.GetOrigin() == camera_opts.look_from);
+        REQUIRE(ray.GetDirection() == screen.GetPointRay(packet.x[i], packet.y[i]));
+    }
+
+    packet.Clear();
+    std::mt19937 random(42);
+    generator.GenerateJittered({0, 0, 40, 30}, 4, &random, &packet);
+    REQUIRE(packet.Size() == 40 * 30 * 4);
+    for (size_t i = 0; i < packet.Size(); ++i) {
+        auto ray = packet.GetRay(i);
+        auto [px, py] = ProjectPoint(screen, ray.GetOrigin() + ray.GetDirection()).value();
+        REQUIRE(std::fabs(px - packet.x[i]) <= 0.5 + 1e-9);
+        REQUIRE(std::fabs(py - packet.y[i]) <= 0.5 + 1e-9);
+    }
+}
+
+TEST_CASE("Float image export") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 32,
+                              .screen_height = 24,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    auto pixels = Raytrace(scene, camera_opts, {4});
+    auto path = std::filesystem::temp_directory_path() / "raytracer_float_image";
+
+    for (auto format : {FloatFormat::kPfm, FloatFormat::kRaw}) {
+        RenderFloatImage(path, format, scene, camera_opts, {4});
+        REQUIRE(std::filesystem::file_size(path) == GetFloatImageSize(32, 24, format));
+
+        auto read = ReadFloatImage(path);
+        REQUIRE(read.Width() == 32);
+        REQUIRE(read.Height() == 24);
+        for (int y = 0; y < 24; ++y) {
+            for (int x = 0; x < 32; ++x) {
+                for (size_t k = 0; k < 3; ++k) {
+                    REQUIRE(read.At(x, y)[k] == static_cast<float>(pixels.At(x, y)[k]));
+                }
+            }
+        }
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Asynchronous image writer") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    RenderOptions render_opts{4};
+    auto dir = std::filesystem::temp_directory_path();
+
+    std::vector<std::pair<CameraOptions, std::filesystem::path>> frames;
+    for (int frame = 0; frame < 4; ++frame) {
+        CameraOptions camera_opts{.screen_width = 64,
+                                  .screen_height = 48,
+                                  .fov = std::numbers::pi / 3,
+                                  .look_from = {0.1 * frame, .7, 1.75},
+                                  .look_to = {0., .7, 0.}};
+        auto path = dir / ("raytracer_frame" + std::to_string(frame) + ".png");
+        frames.emplace_back(camera_opts, path);
+    }
+
+    AsyncImageWriter writer(2, 2);
+    RenderBatch(scene, frames, render_opts, &writer);
+    CHECK(writer.GetPending() == 0);
+
+    for (const auto& [camera_opts, path] : frames) {
+        Image expected(camera_opts.screen_width, camera_opts.screen_height);
+        RenderImage(&expected, scene, camera_opts, render_opts);
+        Compare(Image{path}, expected);
+        std::filesystem::remove(path);
+    }
+}
+
+TEST_CASE("Shadow maps") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions cube_camera{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    CameraOptions cornell_camera{.screen_width = 160,
+                                 .screen_height = 120,
+                                 .look_from = {-.5, 1.5, .98},
+                                 .look_to = {0., 1., 0.}};
+
+    for (const auto& [path, camera_opts] :
+         {std::pair{kTestsDir / "box/cube.obj", cube_camera},
+          std::pair{kTestsDir / "classic_box/CornellBox.obj", cornell_camera}}) {
+        auto scene = ReadScene(path);
+        RenderOptions render_opts{4};
+        render_opts.shadow_maps = ShadowMapOptions{};
+        auto resolution = GetShadowMapResolution(*render_opts.shadow_maps, camera_opts);
+        CHECK(resolution == std::ceil(120 * std::numbers::pi / 2 / camera_opts.fov));
+
+        auto& counters = GetTraceCounters();
+        auto tests = counters.primitive_tests;
+        Image expected(camera_opts.screen_width, camera_opts.screen_height);
+        RenderImage(&expected, scene, camera_opts, {4});
+        auto exact_tests = counters.primitive_tests - tests;
+
+        // Building the maps counts a primitive test per covered texel, so this is the whole cost
+        // of the render and not only of the shadow lookups.
+        tests = counters.primitive_tests;
+        Image image(camera_opts.screen_width, camera_opts.screen_height);
+        RenderImage(&image, scene, camera_opts, render_opts);
+        auto mapped_tests = counters.primitive_tests - tests;
+        CHECK(mapped_tests < exact_tests * 3 / 4);
+
+        int mismatches = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                mismatches += PixelDistance(image.GetPixel(y, x), expected.GetPixel(y, x)) > 8;
+            }
+        }
+        CHECK(mismatches < image.Width() * image.Height() / 100);
+    }
+}
+
+TEST_CASE("Parallel rows") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth}) {
+        RenderOptions render_opts{4, mode};
+        auto expected = Raytrace(scene, camera_opts, render_opts);
+        render_opts.num_threads = 3;
+        for (auto rasterize : {false, true}) {
+            render_opts.rasterize_primary = rasterize;
+            auto pixels = Raytrace(scene, camera_opts, render_opts);
+            for (int y = 0; y < pixels.Height(); ++y) {
+                for (int x = 0; x < pixels.Width(); ++x) {
+                    REQUIRE(pixels.At(x, y) == expected.At(x, y));
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Asynchronous render", "[no_asan]") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = std::make_shared<const Scene>(ReadScene(kTestsDir / "deer/CERF_Free.obj"));
+    CameraOptions camera_opts{.screen_width = 500,
+                              .screen_height = 500,
+                              .look_from = {100, 200, 150},
+                              .look_to = {0, 100, 0}};
+    RenderOptions render_opts{1};
+    render_opts.num_threads = 2;
+
+    {
+        auto handle = RenderAsync(scene, camera_opts, render_opts);
+        CHECK(handle.GetTotalPixels() == 500 * 500);
+        while (handle.GetCompletedPixels() == 0) {
+            std::this_thread::yield();
+        }
+        CHECK(handle.GetProgress() < 1);
+
+        auto start = std::chrono::steady_clock::now();
+        handle.Cancel();
+        REQUIRE(handle.WaitFor(std::chrono::seconds(1)));
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+        CHECK_THROWS_AS(handle.Get(), RenderCancelled);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(20);
+    auto handle = RenderAsync(scene, camera_opts, render_opts, deadline);
+    CHECK_THROWS_AS(handle.Get(), RenderCancelled);
+
+    // Shadow maps and the visibility buffer are built before any pixel is traced, and cancelling
+    // stops them too.
+    auto prepass_opts = render_opts;
+    prepass_opts.shadow_maps = ShadowMapOptions{};
+    prepass_opts.rasterize_primary = true;
+    {
+        auto handle = RenderAsync(scene, camera_opts, prepass_opts);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        CHECK(handle.GetCompletedPixels() == 0);
+
+        auto start = std::chrono::steady_clock::now();
+        handle.Cancel();
+        REQUIRE(handle.WaitFor(std::chrono::seconds(1)));
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(100));
+        CHECK_THROWS_AS(handle.Get(), RenderCancelled);
+    }
+
+    camera_opts.screen_width = camera_opts.screen_height = 32;
+    auto small = RenderAsync(scene, camera_opts, render_opts);
+    auto pixels = small.Get();
+    CHECK(small.GetProgress() == 1);
+    auto expected = Raytrace(*scene, camera_opts, {1});
+    for (int y = 0; y < 32; ++y) {
+        for (int x = 0; x < 32; ++x) {
+            REQUIRE(pixels.At(x, y) == expected.At(x, y));
+        }
+    }
+}
+
+TEST_CASE("Trace timeline") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{4};
+    render_opts.num_threads = 3;
+
+    TraceRecorder recorder;
+    auto untraced = ReadScene(kTestsDir / "box/cube.obj");
+    Raytrace(untraced, camera_opts, render_opts);
+    CHECK(recorder.GetNumEvents() == 0);
+
+    recorder.Start();
+    TraceRecorder other;
+    CHECK_THROWS(other.Start());
+
+    auto scene = ReadScene(kTestsDir / "box/cube.obj", {.num_threads = 2});
+    auto pixels = Raytrace(scene, camera_opts, render_opts);
+    Image image(pixels.Width(), pixels.Height());
+    PostProcess(pixels, render_opts, &image);
+    recorder.Stop();
+    Raytrace(scene, camera_opts, render_opts);
+
+    std::ostringstream os;
+    recorder.WriteJson(os);
+    auto json = os.str();
+    for (const auto* name : {"ReadScene", "ReadObjFile", "ParseObjChunk", "ReadMaterials",
+                             "Scene::Create", "PostProcess", "GetMaxChannel", "ToneMapGamma"}) {
+        CHECK(json.find("\"name\":\"" + std::string(name) + "\"") != std::string::npos);
+    }
+
+    size_t rows = 0;
+    for (auto pos = json.find("\"name\":\"Row\""); pos != std::string::npos;
+         pos = json.find("\"name\":\"Row\"", pos + 1)) {
+        ++rows;
+    }
+    CHECK(rows == 48);
+    CHECK(recorder.GetNumThreads() >= 3);
+    CHECK(json.find("\"ph\":\"M\"") != std::string::npos);
+    CHECK(json.front() == '{');
+    CHECK(json.substr(json.size() - 4) == "\n]}\n");
+}
+
+TEST_CASE("Native polygons") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {-.5, 1.5, 1.98},
+                              .look_to = {0., 1., 0.}};
+
+    for (const auto* path : {"classic_box/CornellBox.obj", "distorted_box/CornellBox.obj",
+                             "mirrors/scene.obj", "smooth_quads/scene.obj"}) {
+        INFO(path);
+        auto fan_scene = ReadScene(kTestsDir / path);
+        auto scene = ReadScene(kTestsDir / path, {.native_polygons = true});
+        REQUIRE(!scene.GetPolygonObjects().empty());
+
+        size_t fan_triangles = scene.GetObjects().size();
+        for (const auto& obj : scene.GetPolygonObjects()) {
+            fan_triangles += obj.num_vertices - 2;
+        }
+        CHECK(fan_triangles == fan_scene.GetObjects().size());
+
+        auto fan_report = fan_scene.GetMemoryReport();
+        auto report = scene.GetMemoryReport();
+        CHECK(report.triangles + report.normals + report.polygons <
+              0.6 * (fan_report.triangles + fan_report.normals));
+
+        auto& counters = GetTraceCounters();
+        auto tests = counters.primitive_tests;
+        auto expected = Raytrace(fan_scene, camera_opts, {4});
+        auto fan_tests = counters.primitive_tests - tests;
+        tests = counters.primitive_tests;
+        auto pixels = Raytrace(scene, camera_opts, {4});
+        auto polygon_tests = counters.primitive_tests - tests;
+        CHECK(polygon_tests < 0.6 * fan_tests);
+
+        // The sides of the cylinder are quads with vertex normals, the cap is a flat polygon.
+        if (std::string_view(path) == "smooth_quads/scene.obj") {
+            auto smooth = std::ranges::count_if(scene.GetPolygonObjects(),
+                                                [](const auto& obj) { return obj.NormalExists(); });
+            CHECK(smooth == 36);
+            CHECK(scene.GetPolygonPool().normals.size() == 12);
+        }
+
+        RenderOptions rasterized{4};
+        rasterized.rasterize_primary = true;
+        auto rasterized_pixels = Raytrace(scene, camera_opts, rasterized);
+
+        // Hit points come from the plane of the polygon instead of the fan triangle, so they
+        // differ in the last bits; interpolated normals and everything else match the fan.
+        for (int y = 0; y < pixels.Height(); ++y) {
+            for (int x = 0; x < pixels.Width(); ++x) {
+                REQUIRE(Length(pixels.At(x, y) - expected.At(x, y)) <=
+                        1e-12 * (1 + Length(expected.At(x, y))));
+                REQUIRE(rasterized_pixels.At(x, y) == pixels.At(x, y));
+            }
+        }
+    }
+}
+
+TEST_CASE("Instruction set dispatch") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj", {.native_polygons = true});
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .look_from = {-.5, 1.5, 1.98},
+                              .look_to = {0., 1., 0.}};
+    RenderOptions render_opts{4};
+
+    SetIsaOverride(Isa::kGeneric);
+    auto expected = Raytrace(scene, camera_opts, render_opts);
+    Image expected_image(expected.Width(), expected.Height());
+    PostProcess(expected, render_opts, &expected_image);
+
+    for (auto isa : {Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+        if (!IsIsaSupported(isa)) {
+            continue;
+        }
+        INFO(GetIsaName(isa));
+        SetIsaOverride(isa);
+        auto pixels = Raytrace(scene, camera_opts, render_opts);
+        Image image(pixels.Width(), pixels.Height());
+        PostProcess(pixels, render_opts, &image);
+        for (int y = 0; y < pixels.Height(); ++y) {
+            for (int x = 0; x < pixels.Width(); ++x) {
+                REQUIRE(pixels.At(x, y) == expected.At(x, y));
+                REQUIRE(image.GetPixel(y, x) == expected_image.GetPixel(y, x));
+            }
+        }
+    }
+    SetIsaOverride(std::nullopt);
+}
+
+TEST_CASE("Fast math") {
+    RenderOptions render_opts{4};
+    render_opts.fast_math = true;
+    CheckImage("shading_parts/scene.obj", "shading_parts/scene.png", {640, 480}, render_opts);
+
+    CameraOptions camera_opts{.screen_width = 640,
+                              .screen_height = 480,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    CheckImage("box/cube.obj", "box/cube.png", camera_opts, render_opts);
+
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto scene = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    camera_opts = {.screen_width = 160,
+                   .screen_height = 120,
+                   .look_from = {-.5, 1.5, 1.98},
+                   .look_to = {0., 1., 0.}};
+    auto expected = Raytrace(scene, camera_opts, {4});
+    auto pixels = Raytrace(scene, camera_opts, render_opts);
+    for (int y = 0; y < pixels.Height(); ++y) {
+        for (int x = 0; x < pixels.Width(); ++x) {
+            auto diff = Length(pixels.At(x, y) - expected.At(x, y));
+            REQUIRE(diff <= 0.01 * Length(expected.At(x, y)));
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed set of workers pulling tasks from a priority queue. Higher priority runs first, equal
+// priorities run in submission order.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t num_threads = std::thread::hardware_concurrency()) {
+        if (num_threads == 0) {
+            num_threads = 1;
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            workers_.emplace_back([this] { WorkerLoop(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stopped_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    template <class F>
+    auto Submit(F&& func, int priority = 0) -> std::future<std::invoke_result_t<F>> {
+        using Result = std::invoke_result_t<F>;
+
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(func));
+        auto future = task->get_future();
+        {
+            std::lock_guard lock(mutex_);
+            tasks_.push({priority, next_sequence_++, [task] { (*task)(); }});
+        }
+        cv_.notify_one();
+        return future;
+    }
+
+    size_t Size() const {
+        return workers_.size();
+    }
+
+private:
+    struct Task {
+        int priority;
+        uint64_t sequence;
+        std::function<void()> run;
+
+        bool operator<(const Task& other) const {
+            if (priority != other.priority) {
+                return priority < other.priority;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    void WorkerLoop() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this] { return stopped_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = tasks_.top();
+                tasks_.pop();
+            }
+            task.run();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::priority_queue<Task> tasks_;
+    uint64_t next_sequence_ = 0;
+    bool stopped_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
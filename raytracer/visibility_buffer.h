@@ -0,0 +1,234 @@
+#pragma once
+
+#include <scene.h>
+#include <ray.h>
+#include <geometry.h>
+#include <pixel_calculator.h>
+#include <render_control.h>
+#include <screen.h>
+#include <trace_recorder.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Closest primitive per pixel for the camera rays of a Screen. Triangles take ids
+// [0, objects.size()), polygons and then spheres follow them in scene order.
+class VisibilityBuffer {
+public:
+    static constexpr int kNoPrimitive = -1;
+
+    VisibilityBuffer(int width, int height)
+        : width_(width),
+          primitives_(static_cast<size_t>(width) * height, kNoPrimitive),
+          depths_(static_cast<size_t>(width) * height, std::numeric_limits<double>::infinity()) {
+    }
+
+    int GetPrimitive(int x, int y) const {
+        return primitives_[Index(x, y)];
+    }
+
+    double GetDepth(int x, int y) const {
+        return depths_[Index(x, y)];
+    }
+
+    void Update(int x, int y, int primitive, double depth) {
+        auto index = Index(x, y);
+        if (depth < depths_[index]) {
+            depths_[index] = depth;
+            primitives_[index] = primitive;
+        }
+    }
+
+private:
+    size_t Index(int x, int y) const {
+        return static_cast<size_t>(y) * width_ + x;
+    }
+
+    int width_;
+    std::vector<int> primitives_;
+    std::vector<double> depths_;
+};
+
+struct PixelRect {
+    int x_min, y_min, x_max, y_max;
+};
+
+// Inverts Screen::GetPointRay: continuous pixel coordinates of the point, with pixel centers at
+// integers. Empty for points on or behind the camera plane.
+std::optional<std::pair<double, double>> ProjectPoint(const Screen& screen, const Vector& point) {
+    const auto& camera_options = screen.GetCameraOptions();
+    const int width = camera_options.screen_width;
+    const int height = camera_options.screen_height;
+    const double scale = std::tan(camera_options.fov / 2);
+    const double aspect = static_cast<double>(width) / height;
+
+    auto offset = point - camera_options.look_from;
+    double w = -DotProduct(offset, screen.GetForward());
+    if (w < kEps) {
+        return std::nullopt;
+    }
+    double x = DotProduct(offset, screen.GetRight()) / w;
+    double y = -DotProduct(offset, screen.GetUp()) / w;
+
+    return std::make_pair((x / (aspect * scale) + 1) * width / 2 - 0.5,
+                          (y / scale + 1) * height / 2 - 0.5);
+}
+
+// Returns the pixel rectangle that contains the projections of all the points, widened by a
+// pixel to stay conservative. Points on or behind the camera plane make the projection
+// unbounded, so the whole screen is returned, unless all of them are behind the camera and the
+// rectangle is empty.
+template <class Points>
+PixelRect ProjectBounds(const Screen& screen, const Points& points) {
+    const auto& camera_options = screen.GetCameraOptions();
+    const int width = camera_options.screen_width;
+    const int height = camera_options.screen_height;
+    const PixelRect full_screen = {0, 0, width - 1, height - 1};
+    const PixelRect empty = {0, 0, -1, -1};
+
+    bool all_behind = true;
+    for (const auto& point : points) {
+        if (DotProduct(point - camera_options.look_from, screen.GetForward()) < 0) {
+            all_behind = false;
+            break;
+        }
+    }
+    if (all_behind) {
+        return empty;
+    }
+
+    double x_min = std::numeric_limits<double>::infinity(), x_max = -x_min;
+    double y_min = x_min, y_max = -x_min;
+    for (const auto& point : points) {
+        auto projection = ProjectPoint(screen, point);
+        if (!projection) {
+            return full_screen;
+        }
+        auto [pixel_x, pixel_y] = projection.value();
+        x_min = std::min(x_min, pixel_x);
+        x_max = std::max(x_max, pixel_x);
+        y_min = std::min(y_min, pixel_y);
+        y_max = std::max(y_max, pixel_y);
+    }
+
+    return {static_cast<int>(std::clamp(std::floor(x_min) - 1, 0., 1. * width)),
+            static_cast<int>(std::clamp(std::floor(y_min) - 1, 0., 1. * height)),
+            static_cast<int>(std::clamp(std::ceil(x_max) + 1, -1., width - 1.)),
+            static_cast<int>(std::clamp(std::ceil(y_max) + 1, -1., height - 1.))};
+}
+
+std::array<Vector, 8> GetBoxCorners(const Sphere& sphere) {
+    std::array<Vector, 8> corners;
+    auto center = sphere.GetCenter();
+    auto radius = sphere.GetRadius();
+    for (size_t i = 0; i < corners.size(); ++i) {
+        corners[i] = center + Vector{i & 1 ? radius : -radius, i & 2 ? radius : -radius,
+                                     i & 4 ? radius : -radius};
+    }
+    return corners;
+}
+
+// Scan-converts every primitive over its projected screen bounds and keeps the nearest exact
+// ray hit per pixel. The work per primitive is proportional to the pixels it covers, so dense
+// meshes cost about a z-buffer pass instead of a full closest-hit search per camera ray. Ties
+// are resolved in Intersect()'s order, so the result matches ray casting. Only the pixels inside
+// window are filled in. A control is checked between rows of the projected bounds.
+VisibilityBuffer RasterizePrimary(const Scene& scene, const Screen& screen,
+                                  const std::optional<PixelRect>& window = std::nullopt,
+                                  const RenderControl* control = nullptr) {
+    TraceScope trace("RasterizePrimary");
+    const auto& camera_options = screen.GetCameraOptions();
+    VisibilityBuffer buffer(camera_options.screen_width, camera_options.screen_height);
+    int rows = 0;
+
+    auto rasterize = [&](int primitive, PixelRect rect, const auto& shape) {
+        if (window) {
+            rect.x_min = std::max(rect.x_min, window->x_min);
+            rect.y_min = std::max(rect.y_min, window->y_min);
+            rect.x_max = std::min(rect.x_max, window->x_max);
+            rect.y_max = std::min(rect.y_max, window->y_max);
+        }
+        for (int y = rect.y_min; y <= rect.y_max; ++y) {
+            if (control && rows++ % RenderControl::kPixelsPerCheck == 0) {
+                control->Check();
+            }
+            for (int x = rect.x_min; x <= rect.x_max; ++x) {
+                auto ray = screen.GetCameraRay(x, y);
+                auto intersection = GetIntersection(ray, shape);
+                if (intersection) {
+                    buffer.Update(x, y, primitive, intersection->GetDistance());
+                }
+            }
+        }
+    };
+
+    int primitive = 0;
+    for (const auto& obj : scene.GetObjects()) {
+        const auto& triangle = obj.polygon;
+        std::array<Vector, 3> vertices = {triangle[0], triangle[1], triangle[2]};
+        rasterize(primitive++, ProjectBounds(screen, vertices), triangle);
+    }
+    const auto& polygons = scene.GetPolygonPool();
+    std::vector<Vector> vertices;
+    for (const auto& obj : polygons.objects) {
+        auto polygon = polygons.GetPolygon(obj);
+        vertices.clear();
+        for (size_t k = 0; k < polygon.Size(); ++k) {
+            vertices.push_back(polygon[k]);
+        }
+        rasterize(primitive++, ProjectBounds(screen, vertices), polygon);
+    }
+    for (const auto& obj : scene.GetSphereObjects()) {
+        rasterize(primitive++, ProjectBounds(screen, GetBoxCorners(obj.sphere)), obj.sphere);
+    }
+
+    return buffer;
+}
+
+// Intersects the ray with a single primitive, identified as in VisibilityBuffer.
+std::optional<std::tuple<Intersection, const Material*, Vector>> IntersectPrimitive(
+    const Ray& ray, const Scene& scene, int primitive) {
+
+    const auto& objects = scene.GetObjects();
+    if (static_cast<size_t>(primitive) < objects.size()) {
+        const auto& obj = objects[primitive];
+        auto intersection = GetIntersection(ray, obj.polygon);
+        if (!intersection) {
+            return std::nullopt;
+        }
+        return MakeIntersectionInfo(intersection.value(), obj);
+    }
+    size_t index = primitive - objects.size();
+    const auto& polygons = scene.GetPolygonPool();
+    if (index < polygons.objects.size()) {
+        const auto& obj = polygons.objects[index];
+        auto intersection = GetIntersection(ray, polygons.GetPolygon(obj));
+        if (!intersection) {
+            return std::nullopt;
+        }
+        return std::make_tuple(intersection.value(), obj.material,
+                               GetNormal(intersection.value(), obj, polygons).Normalized());
+    }
+    const auto& obj = scene.GetSphereObjects()[index - polygons.objects.size()];
+    auto intersection = GetIntersection(ray, obj.sphere);
+    if (!intersection) {
+        return std::nullopt;
+    }
+    return MakeIntersectionInfo(intersection.value(), obj);
+}
+
+std::optional<std::tuple<Intersection, const Material*, Vector>> GetPrimaryHit(
+    const VisibilityBuffer& buffer, const Scene& scene, const Ray& ray, int x, int y) {
+
+    int primitive = buffer.GetPrimitive(x, y);
+    if (primitive == VisibilityBuffer::kNoPrimitive) {
+        return std::nullopt;
+    }
+    return IntersectPrimitive(ray, scene, primitive);
+}